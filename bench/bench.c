@@ -0,0 +1,214 @@
+// textattr benchmarks (C)
+// =======================
+//
+// Copyright (C) 2018, Shriramana Sharma, samjnaa-at-gmail-dot-com
+//
+// Use, modification and distribution are permitted subject to the
+// "BSD-2-Clause"-type license stated in the accompanying file LICENSE.txt
+
+// Prints one JSON object per benchmark on stdout for bench.py to collect, with
+// names prefixed by the first argument if any (such as for builds with TA_STATS).
+// The second argument if any is the path of libta.so for timing dlopen.
+// Link with -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc to count allocations.
+
+#include "textattr.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <dlfcn.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define CYCLES() __rdtsc()
+#else
+#define CYCLES() 0ULL // cycles are reported as 0 where no cycle counter is readily available
+#endif
+
+// allocation counting
+
+static long allocCount = 0;
+void * __real_malloc(size_t size);
+void * __real_calloc(size_t count, size_t size);
+void * __real_realloc(void * ptr, size_t size);
+void * __wrap_malloc(size_t size) { ++allocCount; return __real_malloc(size); }
+void * __wrap_calloc(size_t count, size_t size) { ++allocCount; return __real_calloc(count, size); }
+void * __wrap_realloc(void * ptr, size_t size) { ++allocCount; return __real_realloc(ptr, size); }
+
+// harness
+
+static volatile size_t sink; // to keep results from being optimized away
+
+static double nowNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int compareDoubles(const void * a, const void * b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static const char * namePrefix = "c";
+
+#define repeats 5
+typedef void (* BenchFn)(long iterations);
+
+// reports the median of repeated runs; bytesPerOp is for throughput and may be 0
+static void run(const char * name, BenchFn fn, long iterations, double bytesPerOp)
+{
+    double nsPerOp[repeats], cyclesPerOp[repeats];
+    fn(iterations / 10 + 1); // warm up
+    long allocsBefore = allocCount;
+    for (int r = 0; r < repeats; ++r)
+    {
+        unsigned long long startCycles = CYCLES();
+        double start = nowNs();
+        fn(iterations);
+        nsPerOp[r] = (nowNs() - start) / iterations;
+        cyclesPerOp[r] = (double)(CYCLES() - startCycles) / iterations;
+    }
+    double allocsPerOp = (double)(allocCount - allocsBefore) / (repeats * iterations);
+    qsort(nsPerOp, repeats, sizeof(double), compareDoubles);
+    qsort(cyclesPerOp, repeats, sizeof(double), compareDoubles);
+    double ns = nsPerOp[repeats / 2];
+    printf("{\"name\": \"%s/%s\", \"ns_per_op\": %.2f, \"cycles_per_op\": %.1f, \"allocs_per_op\": %.3f, \"mb_per_s\": ",
+           namePrefix, name, ns, cyclesPerOp[repeats / 2], allocsPerOp);
+    if (bytesPerOp > 0)
+        printf("%.2f}\n", bytesPerOp / ns * 1e3); // bytes per ns is GB/s
+    else
+        printf("null}\n");
+    fflush(stdout);
+}
+
+// benchmarks
+
+static const char * specMix[] = {
+    "f", "+r o", "w /b", "y", "%ff8000", "/^123 u", "a12", "o u i %102030 /%405060",
+    "light-green", "not-bold", "k! /w!", "g i u", "-u", "/gray20 +c", "_ /_", "magenta!"
+};
+#define specMixLen (sizeof(specMix) / sizeof(specMix[0]))
+
+static void benchTaShortcut(long iterations)
+{
+    for (long i = 0; i < iterations; ++i) sink += (size_t)ta("f");
+}
+
+static void benchTaMix(long iterations)
+{
+    for (long i = 0; i < iterations; ++i) sink += (size_t)ta(specMix[i % specMixLen]);
+}
+
+static void benchTaMix256(long iterations)
+{
+    for (long i = 0; i < iterations; ++i) sink += (size_t)ta_p(specMix[i % specMixLen], TA_PROFILE_256);
+}
+
+static void benchTaTrueColor(long iterations)
+{
+    for (long i = 0; i < iterations; ++i) sink += (size_t)ta("%ff8000 /%0080ff");
+}
+
+// as generated by a theming layer, beyond the former limits of 11 specs and 47 bytes of code
+#define longSpec "o i u /%202020 %ff8000 -i -u f o u %80a0ff /%101010 not-underlined e a12"
+
+static void benchTaLongSpec(long iterations)
+{
+    for (long i = 0; i < iterations; ++i) sink += (size_t)ta(longSpec);
+}
+
+static char encodeBuf[256];
+
+static void benchEncodeMix(long iterations) // not cached unlike ta
+{
+    for (long i = 0; i < iterations; ++i)
+        sink += ta_encode(encodeBuf, sizeof encodeBuf, specMix[i % specMixLen], -1, TA_PROFILE_TRUE);
+}
+
+static void benchTaStyle(long iterations)
+{
+    for (long i = 0; i < iterations; ++i) sink += (size_t)ta_style((i & 1) ? "error" : "path");
+}
+
+static FILE * devNull;
+#define TAFWRITE_ARGS "@+r o", "error", "@f", ": could not open ", "@u", "/some/path", "@f", "\n"
+static double tafwriteBytes;
+
+static void benchTafwrite(long iterations)
+{
+    for (long i = 0; i < iterations; ++i) tafwrite(devNull, TAFWRITE_ARGS);
+}
+
+#define gradientCells 80
+static unsigned char gradientRgb[3 * gradientCells];
+static char gradientBuf[gradientCells * 32];
+
+static void benchGradient(long iterations)
+{
+    for (long i = 0; i < iterations; ++i)
+        sink += ta_gradient(gradientBuf, sizeof gradientBuf, gradientRgb, NULL, gradientCells, true, TA_PROFILE_TRUE);
+}
+
+// a help screen of styled paragraphs, reflowed to 80 columns
+#define wrapParagraphs 40
+static char wrapText[wrapParagraphs * 256], wrapBuf[sizeof wrapText * 2];
+static int wrapTextLen;
+
+static void benchWrap(long iterations)
+{
+    for (long i = 0; i < iterations; ++i)
+        sink += ta_wrap(wrapBuf, sizeof wrapBuf, wrapText, wrapTextLen, 80, true);
+}
+
+static const char * libPath;
+
+static void benchDlopen(long iterations)
+{
+    for (long i = 0; i < iterations; ++i)
+    {
+        void * lib = dlopen(libPath, RTLD_NOW | RTLD_LOCAL);
+        if (!lib) { fprintf(stderr, "%s\n", dlerror()); exit(EXIT_FAILURE); }
+        dlclose(lib);
+    }
+}
+
+int main(int argc, char * argv[])
+{
+    if (argc > 1) namePrefix = argv[1];
+
+    char themeFileName[20] = "/tmp/XXXXXX";
+    FILE * themeFile = fdopen(mkstemp(themeFileName), "w");
+    fputs("error = +r o\npath = u %80a0ff\n", themeFile);
+    fclose(themeFile);
+    ta_loadTheme(themeFileName);
+    remove(themeFileName);
+
+    devNull = fopen("/dev/null", "w");
+    tafwriteBytes = strlen(ta("+r o")) + strlen(ta("f")) * 2 + strlen(ta("u")) + strlen("error: could not open /some/path\n");
+    for (int i = 0; i < 3 * gradientCells; ++i) gradientRgb[i] = (i * 7) & 0xff;
+    for (int i = 0; i < wrapParagraphs; ++i)
+        wrapTextLen += sprintf(wrapText + wrapTextLen, "%s%s%s the spec string is parsed %sonce%s and the codes\n"
+                               "for each of the specs are %sjoined%s by semicolons into a single escape\n"
+                               "sequence which can then be written out as many times as needed.\n\n",
+                               ta("+c o"), "Encoding:", ta("f"), ta("u"), ta("-u"), ta("%ff8000"), ta("_"));
+
+    run("ta/f_shortcut", benchTaShortcut, 2000000, 0);
+    run("ta/spec_mix", benchTaMix, 1000000, 0);
+    run("ta/spec_mix_256", benchTaMix256, 1000000, 0);
+    run("ta/true_color", benchTaTrueColor, 1000000, 0);
+    run("ta/long_spec", benchTaLongSpec, 1000000, 0);
+    run("ta_encode/spec_mix", benchEncodeMix, 1000000, 0);
+    run("ta_style/hit", benchTaStyle, 2000000, 0);
+    run("tafwrite/log_line", benchTafwrite, 500000, tafwriteBytes);
+    run("ta_gradient/80_cells", benchGradient, 100000, 0);
+    run("ta_wrap/help_screen", benchWrap, 2000, wrapTextLen);
+    if (argc > 2)
+    {
+        libPath = argv[2];
+        run("dlopen/libta", benchDlopen, 2000, 0);
+    }
+
+    fclose(devNull);
+}
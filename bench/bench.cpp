@@ -0,0 +1,65 @@
+// textattr benchmarks (C++)
+// =========================
+//
+// Copyright (C) 2018, Shriramana Sharma, samjnaa-at-gmail-dot-com
+//
+// Use, modification and distribution are permitted subject to the
+// "BSD-2-Clause"-type license stated in the accompanying file LICENSE.txt
+
+// Prints one JSON object per benchmark on stdout for bench.py to collect.
+
+#include "textattr.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <streambuf>
+
+static volatile size_t sink; // to keep results from being optimized away
+
+class NullBuffer : public std::streambuf
+{
+protected:
+    int overflow(int c) { return c; }
+    std::streamsize xsputn(const char *, std::streamsize n) { return n; }
+};
+
+template<typename Fn> static void run(const char * name, Fn fn, long iterations, double bytesPerOp)
+{
+    const int repeats = 5;
+    double nsPerOp[repeats];
+    fn(iterations / 10 + 1); // warm up
+    for (int r = 0; r < repeats; ++r)
+    {
+        auto start = std::chrono::steady_clock::now();
+        fn(iterations);
+        nsPerOp[r] = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / iterations;
+    }
+    std::sort(nsPerOp, nsPerOp + repeats);
+    double ns = nsPerOp[repeats / 2];
+    std::printf("{\"name\": \"%s\", \"ns_per_op\": %.2f, \"cycles_per_op\": null, \"allocs_per_op\": null, \"mb_per_s\": ", name, ns);
+    if (bytesPerOp > 0)
+        std::printf("%.2f}\n", bytesPerOp / ns * 1e3);
+    else
+        std::printf("null}\n");
+    std::fflush(stdout);
+}
+
+int main()
+{
+    NullBuffer nullBuffer;
+    std::ostream nullStream(&nullBuffer);
+    tastream ta_null(nullStream);
+    double lineBytes = std::strlen(ta("+r o")) + std::strlen(ta("f")) * 2 + std::strlen(ta("u")) +
+                       std::strlen("error: could not open /some/path\n");
+
+    run("cpp/ta/spec", [](long n) { for (long i = 0; i < n; ++i) sink += (size_t)ta("+r o"); }, 1000000, 0);
+    run("cpp/tastream/log_line", [&](long n) {
+        for (long i = 0; i < n; ++i)
+            ta_null << "@+r o" << "error" << "@f" << ": could not open " << "@u" << "/some/path" << "@f" << "\n";
+    }, 500000, lineBytes);
+    run("cpp/tastream/std_string", [&](long n) {
+        std::string spec = "@w /b";
+        for (long i = 0; i < n; ++i) ta_null << spec << "text";
+    }, 500000, 0);
+}
@@ -0,0 +1,159 @@
+#! /usr/bin/env python3
+
+# textattr benchmarks
+# ===================
+#
+# Runs the C and C++ microbenchmarks and measures process spawn cost of the
+# executables, ctypes calls through textattr.py and throughput of the filters
+# on a generated log. Results are written as JSON and may be compared against
+# a saved baseline.
+#
+# Copyright (C) 2018, Shriramana Sharma, samjnaa-at-gmail-dot-com
+#
+# Use, modification and distribution are permitted subject to the
+# "BSD-2-Clause"-type license stated in the accompanying file LICENSE.txt
+
+import json, os, random, statistics, subprocess, sys, time
+
+from argparse import ArgumentParser
+parser = ArgumentParser(description = "Runs the textattr benchmarks")
+parser.add_argument("--build-dir", default = "build", help = "where the executables and libraries are")
+parser.add_argument("--output", help = "JSON file to write results to (default: stdout)")
+parser.add_argument("--baseline", help = "JSON file of earlier results to compare against")
+parser.add_argument("--threshold", type = float, default = 10.0, help = "percentage slowdown deemed a regression (default: 10)")
+parser.add_argument("--quick", action = "store_true", help = "fewer iterations of the spawn, ctypes and filter benchmarks")
+args = parser.parse_args()
+
+repoDir = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+buildDir = os.path.abspath(args.build_dir)
+benchDir = os.path.join(buildDir, "bench")
+scale = 10 if args.quick else 1
+results = []
+
+def result(name, nsPerOp, mbPerS = None):
+    results.append({"name": name, "ns_per_op": round(nsPerOp, 2), "cycles_per_op": None, "allocs_per_op": None,
+                    "mb_per_s": None if mbPerS is None else round(mbPerS, 2)})
+
+def median(fn, repeats = 5):
+    times = []
+    for _ in range(repeats):
+        start = time.perf_counter_ns()
+        fn()
+        times.append(time.perf_counter_ns() - start)
+    return statistics.median(times)
+
+#
+# compiled microbenchmarks
+
+libPath = os.path.join(buildDir, "libta.so")
+for argv in (["bench.c.bin", "c", libPath], ["bench-stats.c.bin", "c-stats"], ["bench-shared.c.bin", "c-shared"],
+             ["bench.cpp.bin", "cpp"]):
+    output = subprocess.run([os.path.join(benchDir, argv[0])] + argv[1:], stdout = subprocess.PIPE, check = True).stdout
+    results.extend(json.loads(line) for line in output.decode().splitlines())
+
+#
+# process spawn cost of the executables, with that of /bin/true for reference
+
+tawrite = os.path.join(benchDir, "tawrite")
+if not os.path.lexists(tawrite):
+    os.symlink(os.path.join(buildDir, "ta"), tawrite)
+
+spawnCount = 200 // scale
+for name, argv in (("spawn/true", ["true"]),
+                   ("spawn/ta", [os.path.join(buildDir, "ta"), "+r", "o"]),
+                   ("spawn/tawrite", [tawrite, "@+r o", "error", "@f", ": message\\n"])):
+    def spawn():
+        for _ in range(spawnCount):
+            subprocess.run(argv, stdout = subprocess.DEVNULL, check = True)
+    result(name, median(spawn, 3) / spawnCount)
+
+#
+# ctypes calls through textattr.py (libta.so is to be found via LD_LIBRARY_PATH)
+
+sys.path.insert(0, os.path.join(repoDir, "lib"))
+import textattr
+
+callCount = 100000 // scale
+specs = ["+r o", "w /b", "%ff8000", "/^123 u", "a12"]
+def callTa():
+    ta = textattr.ta
+    for i in range(callCount):
+        ta(specs[i % 5])
+result("python/ta/spec_mix", median(callTa) / callCount)
+
+#
+# filter throughput on a generated log
+
+random.seed(2018) # for reproducibility
+codes = ["\033[0m", "\033[91;1m", "\033[93m", "\033[4;38;2;128;160;255m", "\033[32m", "\033[48;5;123m"]
+words = ["error", "warning", "compiling", "linking", "src/main.c", "done", "[ 42%]", "->", "ok"]
+logLines = []
+for _ in range(50000 // scale):
+    line = []
+    for _ in range(random.randint(3, 12)):
+        if random.random() < 0.3:
+            line.append(random.choice(codes))
+        line.append(random.choice(words) + " ")
+    logLines.append("".join(line) + "\033[0m\n")
+logData = "".join(logLines).encode()
+logFile = os.path.join(benchDir, "bench.log")
+with open(logFile, "wb") as f:
+    f.write(logData)
+
+for name in ("ta-rm", "ta2html"):
+    def convert():
+        with open(logFile, "rb") as f:
+            subprocess.run([os.path.join(repoDir, "utils", name)], stdin = f, stdout = subprocess.DEVNULL, check = True)
+    ns = median(convert, 3)
+    result("filter/" + name, ns / len(logLines), len(logData) / ns * 1e3)
+
+# ta-grep against grep on the same log stripped of escape codes, for reference
+plainFile = os.path.join(benchDir, "bench.plain.log")
+with open(plainFile, "wb") as f:
+    f.write(subprocess.run([os.path.join(repoDir, "utils", "ta-rm")], input = logData, stdout = subprocess.PIPE, check = True).stdout)
+for name, argv in (("filter/grep-plain", ["grep", "-c", "linking done", plainFile]),
+                   ("filter/ta-grep", [os.path.join(buildDir, "ta-grep"), "-c", "linking done", logFile])):
+    def search():
+        # piped, as grep stops at the first match when its output is /dev/null
+        status = subprocess.run(argv, stdout = subprocess.PIPE).returncode
+        if status > 1: # as with grep, 1 is for no match
+            raise subprocess.CalledProcessError(status, argv)
+    ns = median(search)
+    result(name, ns / len(logLines), len(logData) / ns * 1e3)
+os.remove(logFile)
+os.remove(plainFile)
+
+#
+# output and comparison
+
+output = json.dumps({"results": results}, indent = 1)
+if args.output:
+    with open(args.output, "w") as f:
+        f.write(output + "\n")
+else:
+    print(output)
+
+baseline = {}
+if args.baseline:
+    with open(args.baseline) as f:
+        baseline = {r["name"]: r for r in json.load(f)["results"]}
+
+regressions = 0
+header = "{:32} {:>12} {:>10} {:>10} {:>10}".format("benchmark", "ns/op", "cycles/op", "allocs/op", "MB/s")
+if baseline:
+    header += " {:>10}".format("change")
+sys.stderr.write(header + "\n")
+for r in results:
+    fmt = lambda v, spec: "-" if v is None else format(v, spec)
+    line = "{:32} {:>12} {:>10} {:>10} {:>10}".format(r["name"], fmt(r["ns_per_op"], ".2f"), fmt(r["cycles_per_op"], ".1f"),
+                                                      fmt(r["allocs_per_op"], ".3f"), fmt(r["mb_per_s"], ".2f"))
+    if r["name"] in baseline:
+        change = (r["ns_per_op"] / baseline[r["name"]]["ns_per_op"] - 1) * 100
+        line += " {:>+9.1f}%".format(change)
+        if change > args.threshold:
+            line += "  REGRESSION"
+            regressions += 1
+    sys.stderr.write(line + "\n")
+
+if regressions:
+    exit("{} benchmark(s) slower than the baseline by more than {}%".format(regressions, args.threshold))
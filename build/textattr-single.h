@@ -0,0 +1,1896 @@
+// textattr single header distribution generated from lib/textattr.h and lib/textattr.c
+// #define TEXTATTR_IMPLEMENTATION in exactly one source file before including this
+// textattr (ta)
+// =============
+//
+// Makes adding color and attributes to beautify the terminal output of your
+// program easier by translating human-readable specs into ANSI escape codes
+//
+// Copyright (C) 2018, Shriramana Sharma, samjnaa-at-gmail-dot-com
+//
+// Use, modification and distribution are permitted subject to the
+// "BSD-2-Clause"-type license stated in the accompanying file LICENSE.txt
+
+#ifndef TEXTATTR_H
+#define TEXTATTR_H
+
+#include <stdio.h>
+#include <stdbool.h>
+
+// types
+
+typedef enum { TA_PROFILE_NONE, TA_PROFILE_16, TA_PROFILE_256, TA_PROFILE_TRUE, TA_PROFILE_AUTO } TaProfile;
+
+// functions
+
+// next two lines needed because internal function cannot be named as ta_n
+// due to clash with and use by C++ ta_n which throws
+const char * _ta_n(const char * specString, int specStringLen);
+#if !defined(TA_STATS) && !defined(TA_NO_INLINE)
+#define ta_n _ta_n_inline // see below
+#define ta(SPEC_STRING) _ta_n_inline(SPEC_STRING, -1)
+#else
+#define ta_n _ta_n
+#define ta(SPEC_STRING) _ta_n(SPEC_STRING, -1)
+#endif
+
+// for encoding with a specific output profile instead of taProfile
+const char * _ta_np(const char * specString, int specStringLen, TaProfile profile);
+#define ta_np _ta_np
+#define ta_p(SPEC_STRING, PROFILE) _ta_np(SPEC_STRING, -1, PROFILE)
+
+// detects the profile supported by the terminal at fd (result is cached)
+TaProfile taDetectProfile(int fd);
+
+// named styles from a theme file of lines of the form `name = spec`; the
+// reload is done only if the file has changed since loading if so requested;
+// codes of a replaced theme stay valid as it is never freed
+bool _ta_loadTheme(const char * fileName);
+bool _ta_reloadTheme(bool onlyIfChanged);
+const char * _ta_style(const char * name);
+#define ta_loadTheme _ta_loadTheme
+#define ta_reloadTheme _ta_reloadTheme
+#define ta_style _ta_style
+
+// encodes the spec string into buf instead of a cycling buffer, without any
+// limit on its length; returns the length written, or -1 on error such as buf
+// being too small
+int ta_encode(char * buf, int bufLen, const char * specString, int specStringLen, TaProfile profile);
+
+// writes cellCount cells of text (spaces if cellTexts is NULL) into buf colored
+// by 3 bytes of RGB per cell or by one of the palette specs as per the sample;
+// the palette is encoded afresh on each call into memory of that call, so no
+// palette state is shared between calls; returns the length written, or -1 on
+// error such as buf being too small
+int ta_gradient(char * buf, int bufLen, const unsigned char * rgb,
+                const char * const * cellTexts, int cellCount, bool bkgd, TaProfile profile);
+int ta_heatmap(char * buf, int bufLen, const char * const * palette, int paletteLen,
+               const float * samples, float minSample, float maxSample,
+               const char * const * cellTexts, int cellCount, TaProfile profile);
+
+// wraps text (which may have escape codes) to lines of at most width columns,
+// breaking at whitespace or within longer words, and if reflow, first joining
+// the lines of each paragraph; the colors and attributes in effect are reset at
+// the end of each line and restored at the start of the next; returns the
+// length written, or -1 on error such as buf being too small
+int ta_wrap(char * buf, int bufLen, const char * text, int textLen, int width, bool reflow);
+
+#define tawrite(...)        _tafwrite(stdout, __VA_ARGS__, NULL)
+#define tafwrite(FILE, ...) _tafwrite(FILE,   __VA_ARGS__, NULL)
+void _tafwrite(FILE * ofile, ...);
+
+#ifdef TA_STATS
+// runtime statistics, available when compiled with TA_STATS defined
+
+typedef enum
+{
+    TA_ERROR_EMPTY_SPEC, TA_ERROR_NO_SPECS, TA_ERROR_UNRECOGNIZED,
+    TA_ERROR_RGB_LIMITED, TA_ERROR_RGB_TRUE, TA_ERROR_GRAY, TA_ERROR_OTHER, TA_ERROR_KINDS
+} TaErrorKind;
+
+#define TA_STATS_LATENCY_BUCKETS 24 // bucket i counts latencies below 2 ^ i ns, the last one all beyond
+#define TA_STATS_SPEC_LEN 48        // longer specs are truncated in the top specs report
+
+typedef struct
+{
+    unsigned long long calls, disabled, shortcuts, cacheHits, styleHits; // disabled includes profile none
+    unsigned long long errors[TA_ERROR_KINDS];
+    unsigned long long latency[TA_STATS_LATENCY_BUCKETS];   // only if taStatsLatency
+} TaStats;
+typedef struct { char spec[TA_STATS_SPEC_LEN]; unsigned long long count; } TaSpecCount;
+typedef void (* TaTraceHook)(const char * specString, int specStringLen, const char * codeSeq,
+                             long long latencyNs, void * userData);
+
+void ta_stats(TaStats * stats);               // sums of the counters of all threads
+void ta_resetStats();
+int ta_topSpecs(TaSpecCount * specs, int n);  // most frequent specs if taStatsTopSpecs; returns count filled
+void ta_setTraceHook(TaTraceHook hook, void * userData); // called after each encoding; NULL to remove
+
+extern bool taStatsLatency, taStatsTopSpecs;
+#endif // TA_STATS
+
+// variables
+
+extern bool taDisabled;
+extern const char * taErrorMsg;
+extern FILE * taStderr;
+extern TaProfile taProfile;
+
+// inline fast path
+
+/*
+Unless TA_STATS (which counts these cases) or TA_NO_INLINE is defined, the
+checks for taDisabled and the frequent spec "f" are done inline, so that the
+compiler can fold them away for literal specs without any call to the library.
+*/
+#if !defined(TA_STATS) && !defined(TA_NO_INLINE)
+static inline const char * _ta_n_inline(const char * specString, int specStringLen)
+{
+    if (taDisabled || taProfile == TA_PROFILE_NONE)
+    {
+        taErrorMsg = ""; // clear error message always
+        return "";
+    }
+    if (taProfile != TA_PROFILE_AUTO && specString[0] == 'f' && (specStringLen == 1 || specString[1] == '\0'))
+    {
+        taErrorMsg = "";
+        return "\033[0m";
+    }
+    return _ta_n(specString, specStringLen);
+}
+#endif
+
+#endif // TEXTATTR_H
+#ifdef TEXTATTR_IMPLEMENTATION
+// textattr (ta)
+// =============
+//
+// Makes adding color and attributes to beautify the terminal output of your
+// program easier by translating human-readable specs into ANSI escape codes
+//
+// Copyright (C) 2018, Shriramana Sharma, samjnaa-at-gmail-dot-com
+//
+// Use, modification and distribution are permitted subject to the
+// "BSD-2-Clause"-type license stated in the accompanying file LICENSE.txt
+
+#ifndef TA_CPP
+#include <stdbool.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>  // for strtol, getenv
+#include <stddef.h>  // for offsetof
+#include <string.h>
+#include <assert.h>
+#include <ctype.h>   // for isspace
+#include <unistd.h>  // for isatty
+#include <sys/stat.h> // for stat of theme files
+
+#ifndef TA_CPP
+#include <stdarg.h>
+#endif
+
+#ifdef TA_STATS
+#include <time.h>    // for clock_gettime
+#define TA_STAT(STATEMENT) STATEMENT
+#else
+#define TA_STAT(STATEMENT)
+#endif
+
+// publicly visible variables
+
+bool taDisabled = false;
+const char * taErrorMsg = NULL;
+TaProfile taProfile = TA_PROFILE_TRUE;
+
+#ifndef TA_CPP
+FILE * taStderr = NULL;
+#endif
+
+// wrappers to standard C types/functions
+
+/* NOTE: For cheap substring operations (without involving strcpy) such as to be
+ * able to accept specs as parts of a null-terminated spec string (since such
+ * substrings will not be null-terminated themselves), and since we need to
+ * compute the length of the specs in most cases especially to avoid buffer
+ * overflows, we define a length-aware string type for internal use only.
+ */
+typedef struct { const char * data; int len; } String;
+typedef unsigned char ubyte;
+static String string(const char * data, int len)
+{
+    String temp = {data, len};
+    return temp;
+}
+
+static bool areEqual(String spec, const char * other)
+{
+    return strncmp(spec.data, other, spec.len) == 0 && other[spec.len] == '\0';
+    /* NOTE: The == '\0' above ensures that `other` ends with spec.len. This
+     * check is safe since due to short-circuit evaluation it will be done only
+     * if spec.len number of non-null chars of `other` have been compared and
+     * found identical to the same number of chars of `spec.data`, which is all
+     * non-null, so `other`, being null-terminated, should have the next as '\0'
+     */
+}
+
+static bool areEqualN(const char * a, const char * b, int n) { return strncmp(a, b, n) == 0; }
+
+static inline unsigned hashString(String str) // FNV-1a
+{
+    unsigned hash = 2166136261u;
+    for (int i = 0; i < str.len; ++i)
+        hash = (hash ^ (unsigned char)str.data[i]) * 16777619u;
+    return hash;
+}
+
+static bool checkedAtoi(String spec, int base, int * output)
+// only digits are accepted, unlike strtol which also allows leading whitespace, a sign and 0x
+{
+    if (spec.len == 0) return false;
+    int value = 0;
+    for (int i = 0; i < spec.len; ++i)
+    {
+        int c = spec.data[i], lower = c | 0x20; // latter is lower case for letters
+        int digit = ('0' <= c && c <= '9') ? c - '0' : (('a' <= lower && lower <= 'z') ? lower - 'a' + 10 : base);
+        if (digit >= base || value > 0xffffff) return false; // latter for overflow; no valid code is so big
+        value = value * base + digit;
+    }
+    *output = value;
+    return true;
+}
+
+// helpers for returning from main functions
+
+static char errorMsg[128] = ""; // separate from taErrorMsg which doesn't allow write access
+#ifdef TA_STATS
+static __thread TaErrorKind errorKind = TA_ERROR_OTHER; // to be set before an error message is written for counting it
+#endif
+// NOTE: the functions encoding specs append their codes straight to the run
+// buffer below and return whether they succeeded; the ones that don't recognize
+// a spec return false leaving errorMsg empty, for the calling site to fill in
+static int utf8PrefixLen(const char * str, int maxLen)
+// of the longest prefix of str within maxLen bytes which does not end within a UTF-8 character
+{
+    int len = strnlen(str, maxLen), start = len;
+    while (start > 0 && ((ubyte)str[start - 1] & 0xc0) == 0x80) --start; // continuation bytes
+    if (start == 0) return len; // malformed, so taken as is
+    ubyte lead = str[start - 1];
+    int charLen = (lead >= 0xf0) ? 4 : (lead >= 0xe0) ? 3 : (lead >= 0xc0) ? 2 : 1;
+    return (start - 1 + charLen > len) ? start - 1 : len;
+}
+
+static void endErrorMsgOnCharBoundary()
+// for after snprintf may have cut errorMsg in the middle of a UTF-8 character
+{
+    errorMsg[utf8PrefixLen(errorMsg, sizeof errorMsg - 1)] = '\0';
+}
+
+static bool writeError(const char * fmt, String spec)
+{
+    assert(strstr(fmt, "%.*s")); // to correspond to usage below
+    snprintf(errorMsg, 128, fmt, spec.len, spec.data);
+    return false; // for convenience and brevity of calling code
+}
+
+// helpers to build code string
+
+/*
+Codes are formatted from a table of the decimal strings of 0 to 255 (which is
+all that any code needs) rather than via snprintf, since this is done for every
+spec and every cell of gradients and heatmaps.
+*/
+static char decimalStr[256][4];
+static ubyte decimalLen[256];
+static bool decimalTableReady = false;
+
+static void initDecimalTable()
+{
+    for (int v = 0; v < 256; ++v)
+        decimalLen[v] = snprintf(decimalStr[v], 4, "%d", v);
+    decimalTableReady = true;
+}
+
+/*
+Codes are appended to a run buffer, which is either the caller's (which then
+must be big enough) or one of the cycling buffers below. Each of those is 64
+bytes, which suffices for all but unusually long spec strings, and is replaced
+by a heap buffer grown on demand for longer codes. We will support upto 40
+consecutive invocations of `ta` (such as from a single line of `printf`) after
+which the earliest output codes will be overwritten.
+*/
+#define codeSeqCycBufCount 40
+static char codeSeqCycBuf[codeSeqCycBufCount][64];
+static char * codeSeqLongBuf[codeSeqCycBufCount]; // for longer codes; kept for reuse and never freed
+static int codeSeqLongBufCap[codeSeqCycBufCount];
+static int codeSeqCurIndex = 0;
+
+static char * runBuf;
+static int runBufLen, runBufCap;
+static int runBufSlot; // index of the cycling buffer being written to, -1 for a caller's buffer
+static bool runBufOverflow;
+
+static char * nextCodeSeqBuf()
+{
+    char * buf = codeSeqCycBuf[codeSeqCurIndex];
+    ++codeSeqCurIndex; // for next iteration
+    codeSeqCurIndex %= codeSeqCycBufCount; // only so many buffers available
+    return buf;
+}
+
+static void startCodeSeq()
+{
+    runBufSlot = codeSeqCurIndex;
+    runBuf = nextCodeSeqBuf();
+    runBufLen = 0;
+    runBufCap = 64;
+    runBufOverflow = false;
+    if (!decimalTableReady) initDecimalTable();
+}
+
+__attribute__((noinline)) // keeping appendToRun small enough to be inlined
+static bool growCodeSeqBuf(int needed)
+{
+    if (runBufSlot < 0) return false; // caller's buffer
+    bool inLongBuf = runBuf != codeSeqCycBuf[runBufSlot];
+    if (codeSeqLongBufCap[runBufSlot] < needed)
+    {
+        char * buf = (char *)realloc(codeSeqLongBuf[runBufSlot], needed * 2);
+        if (!buf) return false;
+        codeSeqLongBuf[runBufSlot] = buf;
+        codeSeqLongBufCap[runBufSlot] = needed * 2;
+    }
+    if (!inLongBuf) memcpy(codeSeqLongBuf[runBufSlot], runBuf, runBufLen);
+    runBuf = codeSeqLongBuf[runBufSlot];
+    runBufCap = codeSeqLongBufCap[runBufSlot];
+    return true;
+}
+
+static inline void appendToRun(const char * data, int len)
+{
+    if (runBufLen + len >= runBufCap && !growCodeSeqBuf(runBufLen + len + 1)) // 1 for final null
+    {
+        runBufOverflow = true;
+        return;
+    }
+    memcpy(runBuf + runBufLen, data, len);
+    runBufLen += len;
+}
+
+static inline bool appendCode(int code)
+// the decimal table is to be readied when starting the run
+{
+    appendToRun(decimalStr[code], decimalLen[code]);
+    return true; // for convenience and brevity of calling code
+}
+
+static bool appendRgbCode(int r, int g, int b)
+// to follow the prefix for true colors
+{
+    appendCode(r);
+    appendToRun(";", 1);
+    appendCode(g);
+    appendToRun(";", 1);
+    return appendCode(b);
+}
+
+// main spec to code functions
+
+static const bool NEGATE_ATTR = true, BG_COLOR = true, FIXED_COLOR = true;
+static const bool NORMAL_ATTR = false, FG_COLOR = false, SCHEME_COLOR = false;
+
+// output profiles and downsampling of colors
+
+static TaProfile curProfile = TA_PROFILE_TRUE; // profile for which the current spec string is being encoded
+
+/*
+Colors are downsampled via the xterm 256-color palette: indices 0 to 15 are
+the 16 named colors (taken with their VGA values as in ta2html), 16 to 231 are
+the 6 * 6 * 6 color cube and 232 to 255 are the gray ramp. The tables below are
+filled once on first use, after which downsampling any color is just a few
+lookups and comparisons irrespective of the input. For 16 colors, an RGB color
+is matched against the named colors directly rather than via its nearest xterm
+color, which would often not be the nearest named color.
+*/
+static const ubyte cubeLevel[6] = {0, 95, 135, 175, 215, 255};
+static const ubyte vgaRgb[16][3] = {
+    {0x00, 0x00, 0x00}, {0xaa, 0x00, 0x00}, {0x00, 0xaa, 0x00}, {0xaa, 0x55, 0x00}, // k r g n
+    {0x00, 0x00, 0xaa}, {0xaa, 0x00, 0xaa}, {0x00, 0xaa, 0xaa}, {0xaa, 0xaa, 0xaa}, // b m c l
+    {0x55, 0x55, 0x55}, {0xff, 0x55, 0x55}, {0x55, 0xff, 0x55}, {0xff, 0xff, 0x55}, // d +r +g y
+    {0x55, 0x55, 0xff}, {0xff, 0x55, 0xff}, {0x55, 0xff, 0xff}, {0xff, 0xff, 0xff}, // +b +m +c w
+};
+static ubyte nearestCubeIndex[256]; // component value to nearest cube level index 0 to 5
+static ubyte nearestGrayIndex[256]; // component value to nearest gray ramp index 0 to 23
+static ubyte nearestVgaIndex[256];  // xterm color index (of ^rgb or a#) to nearest named color index 0 to 15
+static bool downsamplingTablesReady = false;
+
+static void getXtermRgb(int index, int rgb[3])
+{
+    if (index < 16)
+        for (int i = 0; i < 3; ++i) rgb[i] = vgaRgb[index][i];
+    else if (index < 232)
+    {
+        index -= 16;
+        rgb[0] = cubeLevel[index / 36]; rgb[1] = cubeLevel[index / 6 % 6]; rgb[2] = cubeLevel[index % 6];
+    }
+    else
+        rgb[0] = rgb[1] = rgb[2] = 8 + (index - 232) * 10;
+}
+
+static int distanceSq(const int a[3], const int b[3])
+{
+    int dr = a[0] - b[0], dg = a[1] - b[1], db = a[2] - b[2];
+    return dr * dr + dg * dg + db * db;
+}
+
+static int rgbToVgaIndex(int r, int g, int b)
+{
+    int rgb[3] = {r, g, b}, vga[3], best = 0, bestDist = 3 * 256 * 256;
+    for (int i = 0; i < 16; ++i)
+    {
+        getXtermRgb(i, vga);
+        int dist = distanceSq(rgb, vga);
+        if (dist < bestDist) { best = i; bestDist = dist; }
+    }
+    return best;
+}
+
+static void initDownsamplingTables()
+{
+    for (int v = 0, c = 0; v < 256; ++v)
+    {
+        if (c < 5 && v - cubeLevel[c] > cubeLevel[c + 1] - v) ++c;
+        nearestCubeIndex[v] = c;
+        int g = (v - 3) / 10; // i.e. (v - 8) / 10 rounded, since gray ramp values are 8 + g * 10
+        nearestGrayIndex[v] = g < 0 ? 0 : (g > 23 ? 23 : g);
+    }
+    for (int index = 0; index < 256; ++index)
+    {
+        int rgb[3];
+        getXtermRgb(index, rgb);
+        nearestVgaIndex[index] = rgbToVgaIndex(rgb[0], rgb[1], rgb[2]);
+    }
+    downsamplingTablesReady = true;
+}
+
+static int rgbToXtermIndex(int r, int g, int b)
+{
+    if (!downsamplingTablesReady) initDownsamplingTables();
+    int rgb[3] = {r, g, b}, cube[3], gray[3];
+    int cubeIndex = 16 + 36 * nearestCubeIndex[r] + 6 * nearestCubeIndex[g] + nearestCubeIndex[b];
+    int grayIndex = 232 + nearestGrayIndex[(r + g + b) / 3];
+    getXtermRgb(cubeIndex, cube);
+    getXtermRgb(grayIndex, gray);
+    return distanceSq(rgb, gray) < distanceSq(rgb, cube) ? grayIndex : cubeIndex;
+}
+
+static bool appendVgaColorCode(int vga, bool bkgd)
+{
+    return appendCode((vga < 8 ? 30 + vga : 90 + vga - 8) + (bkgd ? 10 : 0));
+}
+
+static bool appendXtermColorCode(int index, bool bkgd)
+{
+    if (curProfile != TA_PROFILE_16)
+    {
+        appendToRun(bkgd ? "48;5;" : "38;5;", 5);
+        return appendCode(index);
+    }
+    if (!downsamplingTablesReady) initDownsamplingTables();
+    return appendVgaColorCode(nearestVgaIndex[index], bkgd);
+}
+
+/*
+The profile is detected from the environment as per the usual conventions:
+a non-empty NO_COLOR or a dumb or missing TERM disable output entirely, a
+COLORTERM of truecolor or 24bit indicates support for 24-bit colors and a
+TERM mentioning 256color indicates support for 256 colors. Detection is done
+once per file descriptor since these don't change during a program's run.
+A negative fd skips the isatty check, for when output is captured by a shell.
+*/
+#define detectedProfileCacheLen 17
+static signed char detectedProfileCache[detectedProfileCacheLen]; // for fd + 1; holds profile + 1, 0 if not yet detected
+
+TaProfile taDetectProfile(int fd)
+{
+    if (fd < 0) fd = -1;
+    bool cacheable = fd + 1 < detectedProfileCacheLen;
+    if (cacheable && detectedProfileCache[fd + 1])
+        return (TaProfile)(detectedProfileCache[fd + 1] - 1);
+
+    const char * noColor = getenv("NO_COLOR"), * term = getenv("TERM"), * colorTerm = getenv("COLORTERM");
+    TaProfile profile;
+    if ((noColor && noColor[0]) || (fd >= 0 && !isatty(fd)) || !term || !term[0] || strcmp(term, "dumb") == 0)
+        profile = TA_PROFILE_NONE;
+    else if (colorTerm && (strcmp(colorTerm, "truecolor") == 0 || strcmp(colorTerm, "24bit") == 0))
+        profile = TA_PROFILE_TRUE;
+    else if (strstr(term, "256color"))
+        profile = TA_PROFILE_256;
+    else
+        profile = TA_PROFILE_16;
+
+    if (cacheable)
+        detectedProfileCache[fd + 1] = profile + 1;
+    return profile;
+}
+
+static TaProfile resolveProfile(TaProfile profile, int fd)
+{
+    return profile == TA_PROFILE_AUTO ? taDetectProfile(fd) : profile;
+}
+
+/*
+The names of attributes and colors are kept in a single pool of strings laid
+out as the char array members of a struct, so that their offsets and lengths
+are compile-time constants. Unlike arrays of pointers to string literals, the
+tables then need no relocations when loaded as a shared library, stay in
+read-only pages shared between processes and fit in a few cache lines.
+The fixed colors are given as indices of the 6 * 6 * 6 color cube.
+*/
+#define CUBE(R, G, B) (16 + 36 * R + 6 * G + B)
+#define ATTRS(X) \
+    X(bold,       "o", "bold",       1) \
+    X(faint,      "t", "faint",      2) \
+    X(italic,     "i", "italic",     3) \
+    X(underlined, "u", "underlined", 4) \
+    X(blinking,   "x", "blinking",   5) \
+    X(overlined,  "e", "overlined",  6) \
+    X(reversed,   "v", "reversed",   7) \
+    X(hidden,     "h", "hidden",     8) \
+    X(struckout,  "z", "struckout",  9)
+#define COLORS(X) \
+    X(black,        "k",  "black",         30, CUBE(0, 0, 0)) \
+    X(darkGray,     "d",  "dark-gray",     90, CUBE(1, 1, 1)) \
+    X(lightGray,    "l",  "light-gray",    37, CUBE(3, 3, 3)) \
+    X(white,        "w",  "white",         97, CUBE(5, 5, 5)) \
+    X(red,          "r",  "red",           31, CUBE(3, 0, 0)) \
+    X(green,        "g",  "green",         32, CUBE(0, 3, 0)) \
+    X(blue,         "b",  "blue",          34, CUBE(0, 0, 3)) \
+    X(cyan,         "c",  "cyan",          36, CUBE(0, 3, 3)) \
+    X(magenta,      "m",  "magenta",       35, CUBE(3, 0, 3)) \
+    X(lightRed,     "+r", "light-red",     91, CUBE(5, 1, 1)) \
+    X(lightGreen,   "+g", "light-green",   92, CUBE(1, 5, 1)) \
+    X(lightBlue,    "+b", "light-blue",    94, CUBE(1, 1, 5)) \
+    X(lightCyan,    "+c", "light-cyan",    96, CUBE(1, 5, 5)) \
+    X(lightMagenta, "+m", "light-magenta", 95, CUBE(5, 1, 5)) \
+    X(brown,        "n",  "brown",         33, CUBE(3, 1, 0)) \
+    X(yellow,       "y",  "yellow",        93, CUBE(5, 5, 1)) \
+    X(default,      "_",  "default",       39, 0            )
+
+typedef struct
+{
+    #define X(ID, ABBR, FULL, ...) char ID##Abbr[sizeof ABBR], ID##Full[sizeof FULL];
+    ATTRS(X) COLORS(X)
+    #undef X
+} NamePool;
+static const NamePool namePool = {
+    #define X(ID, ABBR, FULL, ...) ABBR, FULL,
+    ATTRS(X) COLORS(X)
+    #undef X
+};
+
+typedef struct { unsigned short abbr, full; ubyte abbrLen, fullLen, code, fixed; } Name;
+#define NAME(ID, ABBR, FULL, CODE, FIXED) \
+    {offsetof(NamePool, ID##Abbr), offsetof(NamePool, ID##Full), sizeof ABBR - 1, sizeof FULL - 1, CODE, FIXED},
+#define ATTR_NAME(ID, ABBR, FULL, CODE) NAME(ID, ABBR, FULL, CODE, 0)
+static const Name attrNames[] = { ATTRS(ATTR_NAME) };
+static const Name colorNames[] = { COLORS(NAME) };
+#define attrLen (int)(sizeof attrNames / sizeof(Name))
+#define colorLen (int)(sizeof colorNames / sizeof(Name))
+
+static const Name * findName(String spec, const Name * names, int namesLen)
+{
+    const char * pool = (const char *)&namePool;
+    for (const Name * name = names; name < names + namesLen; ++name) // first chars are compared to avoid most memcmp calls
+        if ((spec.len == name->abbrLen && spec.data[0] == pool[name->abbr] && memcmp(spec.data, pool + name->abbr, spec.len) == 0) ||
+            (spec.len == name->fullLen && spec.data[0] == pool[name->full] && memcmp(spec.data, pool + name->full, spec.len) == 0))
+            return name;
+    return NULL;
+}
+
+static bool appendAttrCode(String spec, bool negate)
+{
+    const Name * attr = findName(spec, attrNames, attrLen);
+    if (attr)
+        return appendCode(negate ? (attr->code + 20) : attr->code);
+    return false;
+        // unrecognized attribute
+        // errorMsg would have been cleared; will be added at calling site
+}
+
+static bool appendColorCodeByName(String spec, bool bkgd, bool fixed)
+{
+    const Name * color = findName(spec, colorNames, colorLen);
+    if (color)
+    {
+        if (fixed && color->fixed) // default has no fixed color
+            return appendXtermColorCode(color->fixed, bkgd);
+        else
+            return appendCode(bkgd ? (color->code + 10) : color->code);
+    }
+    return false;
+        // unrecognized color
+        // errorMsg would have been cleared; will be added at calling site
+}
+
+static bool appendColorCodeByRgbLimited(String spec, bool bkgd)
+{
+    int code;
+    if (spec.len != 3 || !checkedAtoi(spec, 6, &code))
+    {
+        TA_STAT(errorKind = TA_ERROR_RGB_LIMITED);
+        return writeError("specifying a color as ‘^rgb’ should be done by three digits in the range 0 to 5; found: ‘%.*s’", spec);
+    }
+    return appendXtermColorCode(16 + code, bkgd);
+    // NOTE: here, if v is a digit in the input @rgb, then the actual component value on a scale of 0 to 255 is:
+    //       0, if v is 0;  95 + 40 * (v - 1), otherwise
+}
+
+static bool appendColorCodeByRgbTrue(String spec, bool bkgd)
+{
+    int rgb, r, g, b;
+    if (spec.len != 6 || !checkedAtoi(spec, 16, &rgb))
+    {
+        TA_STAT(errorKind = TA_ERROR_RGB_TRUE);
+        return writeError("specifying a color as ‘%%rrggbb’ should be done by six hexadecimal digits; found: ‘%.*s’", spec);
+    }
+    b = rgb % 256; rgb /= 256; // integer division
+    g = rgb % 256; r = rgb / 256;
+    if (curProfile == TA_PROFILE_16)
+        return appendVgaColorCode(rgbToVgaIndex(r, g, b), bkgd);
+    if (curProfile != TA_PROFILE_TRUE)
+        return appendXtermColorCode(rgbToXtermIndex(r, g, b), bkgd);
+    appendToRun(bkgd ? "48;2;" : "38;2;", 5);
+    return appendRgbCode(r, g, b);
+}
+
+static bool appendColorCodeByGray(String spec, bool bkgd)
+{
+    int code;
+    if (!checkedAtoi(spec, 10, &code) || code < 1 || code > 24)
+    {
+        TA_STAT(errorKind = TA_ERROR_GRAY);
+        return writeError("specifying a grayscale color as ‘a#’ should be done by integers 1 to 24; found: ‘%.*s’", spec);
+    }
+    return appendXtermColorCode(231 + code, bkgd);
+    // NOTE: here, if v is the input value, then the actual RGB component value on a scale of 0 to 255 is:
+    //       8 + (v - 1) * 10
+}
+
+static bool appendColorCode(String spec, bool bkgd)
+{
+    if (spec.len == 0)
+        return false;
+    if (spec.data[0] == '^')
+        return appendColorCodeByRgbLimited(string(spec.data + 1, spec.len - 1), bkgd);
+    else if (spec.data[0] == '%')
+        return appendColorCodeByRgbTrue(string(spec.data + 1, spec.len - 1), bkgd);
+    else if (spec.data[0] == 'a')
+        return appendColorCodeByGray(string(spec.data + 1, spec.len - 1), bkgd);
+    else if (spec.len > 4 && areEqualN(spec.data, "gray", 4))
+        return appendColorCodeByGray(string(spec.data + 4, spec.len - 4), bkgd);
+    else if (spec.data[spec.len - 1] == '!')
+        return appendColorCodeByName(string(spec.data, spec.len - 1), bkgd, FIXED_COLOR);
+    else
+        return appendColorCodeByName(spec, bkgd, SCHEME_COLOR);
+}
+
+#ifdef TA_STATS
+// runtime statistics
+
+/*
+Counters are kept per thread so that they can be incremented without any
+synchronization. Each thread's counters are allocated on first use and linked
+into a list which is only ever prepended to (atomically), so that snapshots can
+sum them over all threads. They are never freed since a snapshot may be in
+progress. Snapshots taken while other threads are running are approximate.
+
+Latency measurement and tracking of the most frequent specs cost more than the
+plain counters, so they are done only when enabled at runtime.
+*/
+bool taStatsLatency = false, taStatsTopSpecs = false;
+
+#define topSpecSlots 64
+#define topSpecProbes 8
+typedef struct { char spec[TA_STATS_SPEC_LEN]; unsigned long long count; } SpecSlot;
+typedef struct ThreadStats
+{
+    TaStats stats;
+    SpecSlot topSpecs[topSpecSlots];
+    struct ThreadStats * next;
+} ThreadStats;
+static ThreadStats * allThreadStats = NULL;
+static __thread ThreadStats * myThreadStats = NULL; // GCC extension since C11 and C++11 differ on thread_local
+
+static TaTraceHook traceHook = NULL;
+static void * traceHookData = NULL;
+
+static TaStats * threadStats()
+{
+    if (!myThreadStats)
+    {
+        myThreadStats = (ThreadStats *)calloc(1, sizeof(ThreadStats));
+        myThreadStats->next = __atomic_load_n(&allThreadStats, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&allThreadStats, &myThreadStats->next, myThreadStats,
+                                            true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    }
+    return &myThreadStats->stats;
+}
+
+static long long nowNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void countTopSpec(const char * specString, int specStringLen)
+// space-saving counting: a spec not found replaces the least counted one in its probe window
+{
+    int len = specStringLen < TA_STATS_SPEC_LEN ? specStringLen : TA_STATS_SPEC_LEN - 1;
+    unsigned hash = hashString(string(specString, len));
+    SpecSlot * minSlot = NULL;
+    for (int i = 0; i < topSpecProbes; ++i)
+    {
+        SpecSlot * slot = myThreadStats->topSpecs + ((hash + i) % topSpecSlots);
+        if (slot->count && areEqualN(slot->spec, specString, len) && slot->spec[len] == '\0')
+        {
+            ++slot->count;
+            return;
+        }
+        if (!minSlot || slot->count < minSlot->count)
+            minSlot = slot;
+    }
+    memcpy(minSlot->spec, specString, len);
+    minSlot->spec[len] = '\0';
+    ++minSlot->count; // inherits the count of the replaced spec as per the algorithm
+}
+
+static void countError()
+{
+    ++threadStats()->errors[errorKind];
+    errorKind = TA_ERROR_OTHER;
+}
+
+void ta_stats(TaStats * stats)
+{
+    memset(stats, 0, sizeof(TaStats));
+    for (ThreadStats * t = __atomic_load_n(&allThreadStats, __ATOMIC_ACQUIRE); t; t = t->next)
+    {
+        const unsigned long long * from = (const unsigned long long *)&t->stats;
+        unsigned long long * to = (unsigned long long *)stats;
+        for (size_t i = 0; i < sizeof(TaStats) / sizeof(unsigned long long); ++i) // all members are counters
+            to[i] += __atomic_load_n(from + i, __ATOMIC_RELAXED);
+    }
+}
+
+void ta_resetStats()
+{
+    for (ThreadStats * t = __atomic_load_n(&allThreadStats, __ATOMIC_ACQUIRE); t; t = t->next)
+    {
+        memset(&t->stats, 0, sizeof(TaStats));
+        memset(t->topSpecs, 0, sizeof(t->topSpecs));
+    }
+}
+
+static int compareSpecCounts(const void * a, const void * b)
+{
+    unsigned long long x = ((const TaSpecCount *)a)->count, y = ((const TaSpecCount *)b)->count;
+    return (x < y) - (x > y); // descending
+}
+
+int ta_topSpecs(TaSpecCount * specs, int n)
+{
+    static TaSpecCount merged[topSpecSlots * 64]; // enough for 64 threads; beyond that least counted are dropped
+    int mergedLen = 0;
+    for (ThreadStats * t = __atomic_load_n(&allThreadStats, __ATOMIC_ACQUIRE); t; t = t->next)
+        for (int i = 0; i < topSpecSlots; ++i)
+        {
+            SpecSlot * slot = t->topSpecs + i;
+            if (!slot->count) continue;
+            int j;
+            for (j = 0; j < mergedLen; ++j)
+                if (strcmp(merged[j].spec, slot->spec) == 0) break;
+            if (j == mergedLen)
+            {
+                if (mergedLen == topSpecSlots * 64) continue;
+                strcpy(merged[mergedLen].spec, slot->spec);
+                merged[mergedLen++].count = 0;
+            }
+            merged[j].count += slot->count;
+        }
+    qsort(merged, mergedLen, sizeof(TaSpecCount), compareSpecCounts);
+    if (n > mergedLen) n = mergedLen;
+    memcpy(specs, merged, n * sizeof(TaSpecCount));
+    return n;
+}
+
+void ta_setTraceHook(TaTraceHook hook, void * userData)
+{
+    traceHook = hook;
+    traceHookData = userData;
+}
+#endif // TA_STATS
+
+static const char * setAndPrintError(const char * msg)
+{
+    taErrorMsg = msg; // for reading from a calling program even if taStderr is null
+    TA_STAT(countError());
+#ifndef TA_CPP
+    if (taStderr)
+        fprintf(taStderr,
+                isatty(fileno(taStderr)) ?
+                    //  green             white             yellow               off
+                    "\033[32m" "text" "\033[97m" "attr " "\033[93m" "error" "\033[0m" ": %s\n" :
+                    "textattr error: %s\n",
+                msg);
+#endif
+    return ""; // for convenience and brevity of calling code
+}
+
+static bool appendSpecCode(String spec, bool first)
+// classifies a single spec and appends its code to the run buffer; returns false with errorMsg set on error
+{
+    if (!first) appendToRun(";", 1);
+
+    bool success;
+    if (spec.len == 0)
+    {
+        TA_STAT(errorKind = TA_ERROR_EMPTY_SPEC);
+        strcpy(errorMsg, "empty spec found"); // can happen (only) with malformed command-line input
+        return false;
+    }
+    else if (areEqual(spec, "f") || areEqual(spec, "off"))
+        success = appendCode(0);
+    else if (spec.data[0] == '/')
+        success = appendColorCode(string(spec.data + 1, spec.len - 1), BG_COLOR);
+    else if (spec.data[0] == '-')
+        success = appendAttrCode(string(spec.data + 1, spec.len - 1), NEGATE_ATTR);
+    else if (spec.len > 4 && areEqualN(spec.data, "not-", 4))
+        success = appendAttrCode(string(spec.data + 4, spec.len - 4), NEGATE_ATTR);
+    else // attr is tried only if not color, rather than with message for specific color type
+        success = appendColorCode(spec, FG_COLOR) || (errorMsg[0] == '\0' && appendAttrCode(spec, NORMAL_ATTR));
+
+    if (!success && errorMsg[0] == '\0')
+    {
+        TA_STAT(errorKind = TA_ERROR_UNRECOGNIZED);
+        writeError("unrecognized color or attribute name: ‘%.*s’", spec);
+    }
+    return success;
+}
+
+static bool appendCodeSeq(String specStr)
+// single pass over the spec string, each spec being encoded as soon as its end is found,
+// so there is no limit on the number or length of specs other than the run buffer's
+{
+    appendToRun("\033[", 2);
+    bool first = true;
+    for (const char * p = specStr.data, * end = p + specStr.len; p < end; ++p)
+    {
+        if (*p == ' ') continue;
+        const char * specStart = p;
+        while (p < end && *p != ' ') ++p; // p is now at the space ending the spec, skipped by the loop
+        if (!appendSpecCode(string(specStart, p - specStart), first)) return false;
+        first = false;
+    }
+    if (first)
+    {
+        TA_STAT(errorKind = TA_ERROR_NO_SPECS);
+        strcpy(errorMsg, "no specs were input");
+        return false;
+    }
+    appendToRun("m", 1);
+    return true;
+}
+
+static const char * endCodeSeq(bool success)
+// will return the escape code to be sent to the terminal, so downgrading from run buffer to const char *
+{
+    if (!success) return setAndPrintError(errorMsg);
+    if (runBufOverflow) return setAndPrintError("could not allocate memory for code");
+    runBuf[runBufLen] = '\0';
+    return runBuf;
+}
+
+// memoization of codes
+
+/*
+Codes of recently used spec strings are remembered in a small direct-mapped
+cache keyed by the spec string and the profile it was encoded for. A hit is
+copied into the next cycling buffer just like a freshly built code, so that
+the guarantee of 40 consecutive valid outputs holds irrespective of caching.
+Specs with errors are not cached so that their error messages are produced.
+*/
+#define codeCacheSlots 64
+#define codeCacheSpecMax 47 // longer specs and codes beyond 63 bytes are not cached
+typedef struct { char spec[codeCacheSpecMax + 1], code[64]; ubyte specLen, profile; } CodeCacheEntry;
+static CodeCacheEntry codeCache[codeCacheSlots];
+
+static inline CodeCacheEntry * findCodeCacheEntry(String spec)
+{
+    return codeCache + (hashString(spec) ^ curProfile) % codeCacheSlots;
+}
+
+static inline const char * lookupCodeCache(String spec)
+{
+    if (spec.len > codeCacheSpecMax) return NULL;
+    CodeCacheEntry * entry = findCodeCacheEntry(spec);
+    if (entry->specLen != spec.len || entry->profile != curProfile || memcmp(entry->spec, spec.data, spec.len) != 0)
+        return NULL; // NOTE: an unused entry has profile none, for which nothing is looked up
+    return strcpy(nextCodeSeqBuf(), entry->code);
+}
+
+static void storeInCodeCache(String spec, const char * codeSeq, int codeSeqLen)
+{
+    if (spec.len > codeCacheSpecMax || codeSeqLen >= 64) return;
+    CodeCacheEntry * entry = findCodeCacheEntry(spec);
+    memcpy(entry->spec, spec.data, spec.len);
+    entry->specLen = spec.len;
+    entry->profile = curProfile;
+    strcpy(entry->code, codeSeq);
+}
+
+// publicly visible functions
+
+static const char * encodeSpecString(const char * specString, int specStringLen, TaProfile profile)
+{
+    errorMsg[0] = '\0'; // clear error message always
+    taErrorMsg = errorMsg; // including any non-buffer message set by setAndPrintError
+    curProfile = resolveProfile(profile, STDOUT_FILENO);
+    if (taDisabled || curProfile == TA_PROFILE_NONE)
+    {
+        TA_STAT(++threadStats()->disabled);
+        return ""; // NOTE: not checking for errors
+    }
+
+    if (specString[0] == 'f' && (specStringLen == 1 || specString[1] == '\0'))
+    {
+        TA_STAT(++threadStats()->shortcuts);
+        return "\033[0m"; // frequent use
+    }
+
+    String specStr = string(specString, (specStringLen > 0) ? (int)strnlen(specString, specStringLen) : (int)strlen(specString));
+    const char * cachedCodeSeq = lookupCodeCache(specStr);
+    if (cachedCodeSeq)
+    {
+        TA_STAT(++threadStats()->cacheHits);
+        return cachedCodeSeq;
+    }
+
+    startCodeSeq();
+    const char * codeSeq = endCodeSeq(appendCodeSeq(specStr));
+    if (codeSeq[0]) storeInCodeCache(specStr, codeSeq, runBufLen);
+    return codeSeq;
+}
+
+const char * _ta_np(const char * specString, int specStringLen, TaProfile profile)
+{
+#ifdef TA_STATS
+    ++threadStats()->calls;
+    bool timed = taStatsLatency || traceHook;
+    long long start = timed ? nowNs() : 0;
+    const char * codeSeq = encodeSpecString(specString, specStringLen, profile);
+    long long latency = timed ? nowNs() - start : 0;
+    if (taStatsLatency)
+    {
+        int bucket = latency > 0 ? 64 - __builtin_clzll(latency) : 0; // bucket i is for latencies below 2 ^ i ns
+        ++myThreadStats->stats.latency[bucket < TA_STATS_LATENCY_BUCKETS ? bucket : TA_STATS_LATENCY_BUCKETS - 1];
+    }
+    if (taStatsTopSpecs || traceHook)
+    {
+        int len = (specStringLen > 0) ? (int)strnlen(specString, specStringLen) : (int)strlen(specString);
+        if (taStatsTopSpecs) countTopSpec(specString, len);
+        if (traceHook) traceHook(specString, len, codeSeq, latency, traceHookData);
+    }
+    return codeSeq;
+#else
+    return encodeSpecString(specString, specStringLen, profile);
+#endif
+}
+
+const char * _ta_n(const char * specString, int specStringLen)
+{
+    return _ta_np(specString, specStringLen, taProfile);
+}
+
+// encoding into a caller's buffer, and bulk rendering of colored runs
+
+/*
+For ta_encode, gradients and heatmaps the codes are written straight into the
+caller's buffer. For the latter two, a code is written only when the color
+changes from the previous cell.
+*/
+static void appendCellToRun(const char * const * cellTexts, int i)
+{
+    if (cellTexts)
+        appendToRun(cellTexts[i], strlen(cellTexts[i]));
+    else
+        appendToRun(" ", 1);
+}
+
+static TaProfile runProfile(TaProfile profile)
+// for the runs of the public functions, which are taken to be for stdout like the codes of ta
+{
+    return taDisabled ? TA_PROFILE_NONE : resolveProfile(profile, STDOUT_FILENO);
+}
+
+static void startRun(char * buf, int bufLen, TaProfile profile)
+// profile should be already resolved
+{
+    errorMsg[0] = '\0'; // clear error message always
+    taErrorMsg = errorMsg;
+    runBuf = buf;
+    runBufLen = 0;
+    runBufCap = bufLen;
+    runBufSlot = -1;
+    runBufOverflow = false;
+    if (!decimalTableReady) initDecimalTable();
+    if (bufLen < 1) runBufOverflow = true;
+    curProfile = profile;
+}
+
+static bool finishRun()
+// returns false with errorMsg set, but not printed, if the run did not fit in the caller's buffer
+{
+    if (runBufOverflow)
+    {
+        snprintf(errorMsg, 128, "output buffer of length %d is too small", runBufCap);
+        if (runBufCap > 0) runBuf[0] = '\0';
+        return false;
+    }
+    runBuf[runBufLen] = '\0';
+    return true;
+}
+
+static int endRun(bool colored)
+{
+    if (colored)
+        appendToRun("\033[0m", 4);
+    if (!finishRun())
+    {
+        setAndPrintError(errorMsg);
+        return -1;
+    }
+    return runBufLen;
+}
+
+static int encodeIntoBuf(char * buf, int bufLen, String specStr, TaProfile profile)
+// for ta_encode and theme files; profile should be already resolved, and errors are not printed
+{
+    startRun(buf, bufLen, profile);
+    if (curProfile != TA_PROFILE_NONE && !appendCodeSeq(specStr))
+    {
+        if (bufLen > 0) buf[0] = '\0';
+        return -1;
+    }
+    return finishRun() ? runBufLen : -1;
+}
+
+int ta_encode(char * buf, int bufLen, const char * specString, int specStringLen, TaProfile profile)
+{
+    String specStr = string(specString, (specStringLen > 0) ? (int)strnlen(specString, specStringLen) : (int)strlen(specString));
+    int codeLen = encodeIntoBuf(buf, bufLen, specStr, runProfile(profile));
+    if (codeLen < 0) setAndPrintError(errorMsg);
+    return codeLen;
+}
+
+int ta_gradient(char * buf, int bufLen, const unsigned char * rgb,
+                const char * const * cellTexts, int cellCount, bool bkgd, TaProfile profile)
+{
+    startRun(buf, bufLen, runProfile(profile));
+    if (curProfile != TA_PROFILE_TRUE && !downsamplingTablesReady) initDownsamplingTables();
+
+    int prevKey = -1;
+    for (int i = 0; i < cellCount && !runBufOverflow; ++i, rgb += 3)
+    {
+        if (curProfile == TA_PROFILE_TRUE)
+        {
+            int key = rgb[0] << 16 | rgb[1] << 8 | rgb[2];
+            if (key != prevKey)
+            {
+                appendToRun(bkgd ? "\033[48;2;" : "\033[38;2;", 7);
+                appendRgbCode(rgb[0], rgb[1], rgb[2]);
+                appendToRun("m", 1);
+            }
+            prevKey = key;
+        }
+        else if (curProfile == TA_PROFILE_16) // directly as for %rrggbb
+        {
+            int key = rgbToVgaIndex(rgb[0], rgb[1], rgb[2]);
+            if (key != prevKey)
+            {
+                appendToRun("\033[", 2);
+                appendVgaColorCode(key, bkgd);
+                appendToRun("m", 1);
+            }
+            prevKey = key;
+        }
+        else if (curProfile != TA_PROFILE_NONE)
+        {
+            int key = rgbToXtermIndex(rgb[0], rgb[1], rgb[2]);
+            if (key != prevKey)
+            {
+                appendToRun("\033[", 2);
+                appendXtermColorCode(key, bkgd);
+                appendToRun("m", 1);
+            }
+            prevKey = key;
+        }
+        appendCellToRun(cellTexts, i);
+    }
+    return endRun(prevKey != -1);
+}
+
+static int maxCodeLen(int specStringLen)
+// bounds the length of the code for a spec string, for sizing a buffer to encode it into: every spec
+// takes at least 2 characters with its separating space and gives at most 17 bytes such as "48;2;255;255;255;"
+{
+    return 2 + 17 * ((specStringLen + 1) / 2) + 2; // with "\033[" and "m" plus the final null
+}
+
+int ta_heatmap(char * buf, int bufLen, const char * const * palette, int paletteLen,
+               const float * samples, float minSample, float maxSample,
+               const char * const * cellTexts, int cellCount, TaProfile profile)
+{
+    if (paletteLen < 1)
+    {
+        snprintf(errorMsg, 128, "palette should have at least 1 spec; found: %d", paletteLen);
+        setAndPrintError(errorMsg);
+        return -1;
+    }
+    // each palette spec is encoded only once, into a block allocated per call as specs can be of any length
+    int codesCap = 0;
+    for (int i = 0; i < paletteLen; ++i)
+        codesCap += maxCodeLen(strlen(palette[i]));
+    int * codeStarts = (int *)malloc((paletteLen + 1) * sizeof(int));
+    char * codes = (char *)malloc(codesCap);
+    if (!codeStarts || !codes)
+    {
+        free(codeStarts);
+        free(codes);
+        setAndPrintError("could not allocate memory for palette codes");
+        return -1;
+    }
+    codeStarts[0] = 0;
+    for (int i = 0; i < paletteLen; ++i)
+    {
+        int codeLen = ta_encode(codes + codeStarts[i], codesCap - codeStarts[i], palette[i], -1, profile);
+        if (codeLen < 0) // error message would have been set already
+        {
+            free(codeStarts);
+            free(codes);
+            return -1;
+        }
+        codeStarts[i + 1] = codeStarts[i] + codeLen;
+    }
+    bool colored = codeStarts[paletteLen] > 0;
+
+    startRun(buf, bufLen, runProfile(profile));
+    float scale = (maxSample > minSample) ? paletteLen / (maxSample - minSample) : 0;
+    int prevIndex = -1;
+    for (int i = 0; i < cellCount && !runBufOverflow; ++i)
+    {
+        float pos = (samples[i] - minSample) * scale;
+        int index = (pos >= paletteLen) ? paletteLen - 1 : (pos > 0 ? (int)pos : 0); // also for NaN
+        if (index != prevIndex)
+            appendToRun(codes + codeStarts[index], codeStarts[index + 1] - codeStarts[index]);
+        prevIndex = index;
+        appendCellToRun(cellTexts, i);
+    }
+    free(codeStarts);
+    free(codes);
+    return endRun(colored && cellCount > 0);
+}
+
+// wrapping and reflowing text with escape codes
+
+/*
+Text is copied to the caller's buffer a word at a time, a word being a run of
+characters other than whitespace and newlines, which may include escape codes.
+A line is broken before a word which would not fit (or within a word longer
+than the width) and the whitespace there is dropped. With reflow, the lines of
+each paragraph (which are separated by blank lines) are first joined by single
+spaces.
+
+The colors and attributes in effect are tracked as the escape codes are copied,
+so that at the end of each line they are reset, and at the start of the next
+line they are restored by a single code. Widths are of UTF-8 characters, with
+East Asian wide ones (emoji among them) taking two columns and combining marks
+and format characters none, like wcwidth but without depending on the locale.
+*/
+
+/*
+Sorted ranges of code points of wide characters (of East Asian width W or F, and
+the unassigned ones of the CJK blocks and planes which are wide by default) and
+of zero width characters (of general category Mn, Me or Cf, except the soft
+hyphen and the prepended concatenation marks, which are visible), generated from
+the Unicode 14.0 data of Python's unicodedata, each range merged across any
+unassigned code points up to the next one
+*/
+static const int wideRanges[][2] =
+{
+    {0x1100, 0x115f}, {0x231a, 0x231b}, {0x2329, 0x232a}, {0x23e9, 0x23ec}, {0x23f0, 0x23f0}, {0x23f3, 0x23f3},
+    {0x25fd, 0x25fe}, {0x2614, 0x2615}, {0x2648, 0x2653}, {0x267f, 0x267f}, {0x2693, 0x2693}, {0x26a1, 0x26a1},
+    {0x26aa, 0x26ab}, {0x26bd, 0x26be}, {0x26c4, 0x26c5}, {0x26ce, 0x26ce}, {0x26d4, 0x26d4}, {0x26ea, 0x26ea},
+    {0x26f2, 0x26f3}, {0x26f5, 0x26f5}, {0x26fa, 0x26fa}, {0x26fd, 0x26fd}, {0x2705, 0x2705}, {0x270a, 0x270b},
+    {0x2728, 0x2728}, {0x274c, 0x274c}, {0x274e, 0x274e}, {0x2753, 0x2755}, {0x2757, 0x2757}, {0x2795, 0x2797},
+    {0x27b0, 0x27b0}, {0x27bf, 0x27bf}, {0x2b1b, 0x2b1c}, {0x2b50, 0x2b50}, {0x2b55, 0x2b55}, {0x2e80, 0x303e},
+    {0x3041, 0x3247}, {0x3250, 0x4dbf}, {0x4e00, 0xa4c6}, {0xa960, 0xa97c}, {0xac00, 0xd7a3}, {0xf900, 0xfaff},
+    {0xfe10, 0xfe19}, {0xfe30, 0xfe6b}, {0xff01, 0xff60}, {0xffe0, 0xffe6}, {0x16fe0, 0x1b2fb}, {0x1f004, 0x1f004},
+    {0x1f0cf, 0x1f0cf}, {0x1f18e, 0x1f18e}, {0x1f191, 0x1f19a}, {0x1f200, 0x1f320}, {0x1f32d, 0x1f335},
+    {0x1f337, 0x1f37c}, {0x1f37e, 0x1f393}, {0x1f3a0, 0x1f3ca}, {0x1f3cf, 0x1f3d3}, {0x1f3e0, 0x1f3f0},
+    {0x1f3f4, 0x1f3f4}, {0x1f3f8, 0x1f43e}, {0x1f440, 0x1f440}, {0x1f442, 0x1f4fc}, {0x1f4ff, 0x1f53d},
+    {0x1f54b, 0x1f54e}, {0x1f550, 0x1f567}, {0x1f57a, 0x1f57a}, {0x1f595, 0x1f596}, {0x1f5a4, 0x1f5a4},
+    {0x1f5fb, 0x1f64f}, {0x1f680, 0x1f6c5}, {0x1f6cc, 0x1f6cc}, {0x1f6d0, 0x1f6d2}, {0x1f6d5, 0x1f6df},
+    {0x1f6eb, 0x1f6ec}, {0x1f6f4, 0x1f6fc}, {0x1f7e0, 0x1f7f0}, {0x1f90c, 0x1f93a}, {0x1f93c, 0x1f945},
+    {0x1f947, 0x1f9ff}, {0x1fa70, 0x1faf6}, {0x20000, 0x3fffd}
+};
+static const int zeroWidthRanges[][2] =
+{
+    {0x0300, 0x036f}, {0x0483, 0x0489}, {0x0591, 0x05bd}, {0x05bf, 0x05bf}, {0x05c1, 0x05c2}, {0x05c4, 0x05c5},
+    {0x05c7, 0x05c7}, {0x0610, 0x061a}, {0x061c, 0x061c}, {0x064b, 0x065f}, {0x0670, 0x0670}, {0x06d6, 0x06dc},
+    {0x06df, 0x06e4}, {0x06e7, 0x06e8}, {0x06ea, 0x06ed}, {0x0711, 0x0711}, {0x0730, 0x074a}, {0x07a6, 0x07b0},
+    {0x07eb, 0x07f3}, {0x07fd, 0x07fd}, {0x0816, 0x0819}, {0x081b, 0x0823}, {0x0825, 0x0827}, {0x0829, 0x082d},
+    {0x0859, 0x085b}, {0x0898, 0x089f}, {0x08ca, 0x08e1}, {0x08e3, 0x0902}, {0x093a, 0x093a}, {0x093c, 0x093c},
+    {0x0941, 0x0948}, {0x094d, 0x094d}, {0x0951, 0x0957}, {0x0962, 0x0963}, {0x0981, 0x0981}, {0x09bc, 0x09bc},
+    {0x09c1, 0x09c4}, {0x09cd, 0x09cd}, {0x09e2, 0x09e3}, {0x09fe, 0x0a02}, {0x0a3c, 0x0a3c}, {0x0a41, 0x0a51},
+    {0x0a70, 0x0a71}, {0x0a75, 0x0a75}, {0x0a81, 0x0a82}, {0x0abc, 0x0abc}, {0x0ac1, 0x0ac8}, {0x0acd, 0x0acd},
+    {0x0ae2, 0x0ae3}, {0x0afa, 0x0b01}, {0x0b3c, 0x0b3c}, {0x0b3f, 0x0b3f}, {0x0b41, 0x0b44}, {0x0b4d, 0x0b56},
+    {0x0b62, 0x0b63}, {0x0b82, 0x0b82}, {0x0bc0, 0x0bc0}, {0x0bcd, 0x0bcd}, {0x0c00, 0x0c00}, {0x0c04, 0x0c04},
+    {0x0c3c, 0x0c3c}, {0x0c3e, 0x0c40}, {0x0c46, 0x0c56}, {0x0c62, 0x0c63}, {0x0c81, 0x0c81}, {0x0cbc, 0x0cbc},
+    {0x0cbf, 0x0cbf}, {0x0cc6, 0x0cc6}, {0x0ccc, 0x0ccd}, {0x0ce2, 0x0ce3}, {0x0d00, 0x0d01}, {0x0d3b, 0x0d3c},
+    {0x0d41, 0x0d44}, {0x0d4d, 0x0d4d}, {0x0d62, 0x0d63}, {0x0d81, 0x0d81}, {0x0dca, 0x0dca}, {0x0dd2, 0x0dd6},
+    {0x0e31, 0x0e31}, {0x0e34, 0x0e3a}, {0x0e47, 0x0e4e}, {0x0eb1, 0x0eb1}, {0x0eb4, 0x0ebc}, {0x0ec8, 0x0ecd},
+    {0x0f18, 0x0f19}, {0x0f35, 0x0f35}, {0x0f37, 0x0f37}, {0x0f39, 0x0f39}, {0x0f71, 0x0f7e}, {0x0f80, 0x0f84},
+    {0x0f86, 0x0f87}, {0x0f8d, 0x0fbc}, {0x0fc6, 0x0fc6}, {0x102d, 0x1030}, {0x1032, 0x1037}, {0x1039, 0x103a},
+    {0x103d, 0x103e}, {0x1058, 0x1059}, {0x105e, 0x1060}, {0x1071, 0x1074}, {0x1082, 0x1082}, {0x1085, 0x1086},
+    {0x108d, 0x108d}, {0x109d, 0x109d}, {0x135d, 0x135f}, {0x1712, 0x1714}, {0x1732, 0x1733}, {0x1752, 0x1753},
+    {0x1772, 0x1773}, {0x17b4, 0x17b5}, {0x17b7, 0x17bd}, {0x17c6, 0x17c6}, {0x17c9, 0x17d3}, {0x17dd, 0x17dd},
+    {0x180b, 0x180f}, {0x1885, 0x1886}, {0x18a9, 0x18a9}, {0x1920, 0x1922}, {0x1927, 0x1928}, {0x1932, 0x1932},
+    {0x1939, 0x193b}, {0x1a17, 0x1a18}, {0x1a1b, 0x1a1b}, {0x1a56, 0x1a56}, {0x1a58, 0x1a60}, {0x1a62, 0x1a62},
+    {0x1a65, 0x1a6c}, {0x1a73, 0x1a7f}, {0x1ab0, 0x1b03}, {0x1b34, 0x1b34}, {0x1b36, 0x1b3a}, {0x1b3c, 0x1b3c},
+    {0x1b42, 0x1b42}, {0x1b6b, 0x1b73}, {0x1b80, 0x1b81}, {0x1ba2, 0x1ba5}, {0x1ba8, 0x1ba9}, {0x1bab, 0x1bad},
+    {0x1be6, 0x1be6}, {0x1be8, 0x1be9}, {0x1bed, 0x1bed}, {0x1bef, 0x1bf1}, {0x1c2c, 0x1c33}, {0x1c36, 0x1c37},
+    {0x1cd0, 0x1cd2}, {0x1cd4, 0x1ce0}, {0x1ce2, 0x1ce8}, {0x1ced, 0x1ced}, {0x1cf4, 0x1cf4}, {0x1cf8, 0x1cf9},
+    {0x1dc0, 0x1dff}, {0x200b, 0x200f}, {0x202a, 0x202e}, {0x2060, 0x206f}, {0x20d0, 0x20f0}, {0x2cef, 0x2cf1},
+    {0x2d7f, 0x2d7f}, {0x2de0, 0x2dff}, {0x302a, 0x302d}, {0x3099, 0x309a}, {0xa66f, 0xa672}, {0xa674, 0xa67d},
+    {0xa69e, 0xa69f}, {0xa6f0, 0xa6f1}, {0xa802, 0xa802}, {0xa806, 0xa806}, {0xa80b, 0xa80b}, {0xa825, 0xa826},
+    {0xa82c, 0xa82c}, {0xa8c4, 0xa8c5}, {0xa8e0, 0xa8f1}, {0xa8ff, 0xa8ff}, {0xa926, 0xa92d}, {0xa947, 0xa951},
+    {0xa980, 0xa982}, {0xa9b3, 0xa9b3}, {0xa9b6, 0xa9b9}, {0xa9bc, 0xa9bd}, {0xa9e5, 0xa9e5}, {0xaa29, 0xaa2e},
+    {0xaa31, 0xaa32}, {0xaa35, 0xaa36}, {0xaa43, 0xaa43}, {0xaa4c, 0xaa4c}, {0xaa7c, 0xaa7c}, {0xaab0, 0xaab0},
+    {0xaab2, 0xaab4}, {0xaab7, 0xaab8}, {0xaabe, 0xaabf}, {0xaac1, 0xaac1}, {0xaaec, 0xaaed}, {0xaaf6, 0xaaf6},
+    {0xabe5, 0xabe5}, {0xabe8, 0xabe8}, {0xabed, 0xabed}, {0xfb1e, 0xfb1e}, {0xfe00, 0xfe0f}, {0xfe20, 0xfe2f},
+    {0xfeff, 0xfeff}, {0xfff9, 0xfffb}, {0x101fd, 0x101fd}, {0x102e0, 0x102e0}, {0x10376, 0x1037a}, {0x10a01, 0x10a0f},
+    {0x10a38, 0x10a3f}, {0x10ae5, 0x10ae6}, {0x10d24, 0x10d27}, {0x10eab, 0x10eac}, {0x10f46, 0x10f50},
+    {0x10f82, 0x10f85}, {0x11001, 0x11001}, {0x11038, 0x11046}, {0x11070, 0x11070}, {0x11073, 0x11074},
+    {0x1107f, 0x11081}, {0x110b3, 0x110b6}, {0x110b9, 0x110ba}, {0x110c2, 0x110c2}, {0x11100, 0x11102},
+    {0x11127, 0x1112b}, {0x1112d, 0x11134}, {0x11173, 0x11173}, {0x11180, 0x11181}, {0x111b6, 0x111be},
+    {0x111c9, 0x111cc}, {0x111cf, 0x111cf}, {0x1122f, 0x11231}, {0x11234, 0x11234}, {0x11236, 0x11237},
+    {0x1123e, 0x1123e}, {0x112df, 0x112df}, {0x112e3, 0x112ea}, {0x11300, 0x11301}, {0x1133b, 0x1133c},
+    {0x11340, 0x11340}, {0x11366, 0x11374}, {0x11438, 0x1143f}, {0x11442, 0x11444}, {0x11446, 0x11446},
+    {0x1145e, 0x1145e}, {0x114b3, 0x114b8}, {0x114ba, 0x114ba}, {0x114bf, 0x114c0}, {0x114c2, 0x114c3},
+    {0x115b2, 0x115b5}, {0x115bc, 0x115bd}, {0x115bf, 0x115c0}, {0x115dc, 0x115dd}, {0x11633, 0x1163a},
+    {0x1163d, 0x1163d}, {0x1163f, 0x11640}, {0x116ab, 0x116ab}, {0x116ad, 0x116ad}, {0x116b0, 0x116b5},
+    {0x116b7, 0x116b7}, {0x1171d, 0x1171f}, {0x11722, 0x11725}, {0x11727, 0x1172b}, {0x1182f, 0x11837},
+    {0x11839, 0x1183a}, {0x1193b, 0x1193c}, {0x1193e, 0x1193e}, {0x11943, 0x11943}, {0x119d4, 0x119db},
+    {0x119e0, 0x119e0}, {0x11a01, 0x11a0a}, {0x11a33, 0x11a38}, {0x11a3b, 0x11a3e}, {0x11a47, 0x11a47},
+    {0x11a51, 0x11a56}, {0x11a59, 0x11a5b}, {0x11a8a, 0x11a96}, {0x11a98, 0x11a99}, {0x11c30, 0x11c3d},
+    {0x11c3f, 0x11c3f}, {0x11c92, 0x11ca7}, {0x11caa, 0x11cb0}, {0x11cb2, 0x11cb3}, {0x11cb5, 0x11cb6},
+    {0x11d31, 0x11d45}, {0x11d47, 0x11d47}, {0x11d90, 0x11d91}, {0x11d95, 0x11d95}, {0x11d97, 0x11d97},
+    {0x11ef3, 0x11ef4}, {0x13430, 0x13438}, {0x16af0, 0x16af4}, {0x16b30, 0x16b36}, {0x16f4f, 0x16f4f},
+    {0x16f8f, 0x16f92}, {0x16fe4, 0x16fe4}, {0x1bc9d, 0x1bc9e}, {0x1bca0, 0x1cf46}, {0x1d167, 0x1d169},
+    {0x1d173, 0x1d182}, {0x1d185, 0x1d18b}, {0x1d1aa, 0x1d1ad}, {0x1d242, 0x1d244}, {0x1da00, 0x1da36},
+    {0x1da3b, 0x1da6c}, {0x1da75, 0x1da75}, {0x1da84, 0x1da84}, {0x1da9b, 0x1daaf}, {0x1e000, 0x1e02a},
+    {0x1e130, 0x1e136}, {0x1e2ae, 0x1e2ae}, {0x1e2ec, 0x1e2ef}, {0x1e8d0, 0x1e8d6}, {0x1e944, 0x1e94a},
+    {0xe0001, 0xe01ef}
+};
+
+static bool isInRanges(int codePoint, const int (* ranges)[2], int count)
+{
+    int lo = 0, hi = count - 1;
+    while (lo <= hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (codePoint < ranges[mid][0]) hi = mid - 1;
+        else if (codePoint > ranges[mid][1]) lo = mid + 1;
+        else return true;
+    }
+    return false;
+}
+
+// gives the length in bytes of the character or escape code at cur, and its width
+static int measureChar(const char * cur, const char * end, int * width)
+{
+    ubyte c = *cur;
+    if (c >= 0x20 && c < 0x7f) { *width = 1; return 1; }
+
+    *width = 0;
+    if (c == '\033')
+    {
+        const char * next = cur + 1;
+        if (next < end && *next == '[') // control sequence: parameters then a final byte
+        {
+            for (++next; next < end && (*next < 0x40 || *next > 0x7e); ++next);
+            return (next < end ? next + 1 : end) - cur;
+        }
+        if (next < end && *next == ']') // operating system command such as for a hyperlink
+        {
+            for (++next; next < end && *next != '\a' && !(*next == '\033' && next + 1 < end && next[1] == '\\'); ++next);
+            return (next < end ? next + (*next == '\a' ? 1 : 2) : end) - cur;
+        }
+        while (next < end && *next >= 0x20 && *next <= 0x2f) ++next; // intermediate bytes such as of "\033(B"
+        return (next < end ? next + 1 : end) - cur; // then a final byte
+    }
+    if (c < 0x80) return 1; // other control characters
+
+    int len = (c >= 0xf0) ? 4 : (c >= 0xe0) ? 3 : (c >= 0xc0) ? 2 : 1;
+    int codePoint = (len == 4) ? c & 0x07 : (len == 3) ? c & 0x0f : c & 0x1f;
+    for (int i = 1; i < len; ++i)
+        if (cur + i >= end || ((ubyte)cur[i] & 0xc0) != 0x80)
+            len = 1; // malformed so taken as a single byte
+        else
+            codePoint = codePoint << 6 | ((ubyte)cur[i] & 0x3f);
+    if (len == 1)
+        *width = 1;
+    else if (!isInRanges(codePoint, zeroWidthRanges, sizeof(zeroWidthRanges) / sizeof(zeroWidthRanges[0])))
+        *width = isInRanges(codePoint, wideRanges, sizeof(wideRanges) / sizeof(wideRanges[0])) ? 2 : 1;
+    return len;
+}
+
+/*
+The colors and attributes set by SGR codes are tracked as a change of state:
+the attributes turned on and off and the colors set since some point, or, if a
+reset was seen, the whole state since then. A state proper is thus just a
+change which includes a reset. ta_wrap tracks a state from the start of its
+text, and ta-grep (which includes this file) the changes within each chunk of
+its input as the state at the start of the chunk is not known. An empty color
+means unchanged, or the default if reset, and the color codes are kept as given
+(such as "38;2;255;128;0") so that they are restored as given.
+*/
+typedef struct
+{
+    bool reset;
+    unsigned short on, off; // bit n for the attribute with code n from 1 to 9
+    char fg[20], bg[20];    // NUL-terminated
+} SgrState;
+
+static const SgrState defaultSgrState = {true, 0, 0, "", ""};
+
+static void setSgrAttr(SgrState * state, int code, bool on)
+{
+    unsigned short bit = 1 << code;
+    if (on) { state->on |= bit; state->off &= ~bit; }
+    else    { state->off |= bit; state->on &= ~bit; }
+}
+
+static void setSgrColor(char * color, const char * code, int codeLen)
+{
+    if (codeLen < 20) // longer is malformed, so ignored
+    {
+        memcpy(color, code, codeLen);
+        color[codeLen] = '\0';
+    }
+}
+
+// applies the parameters of an SGR code i.e. what is between "\033[" and "m"
+static void applySgrParams(SgrState * state, const char * params, int paramsLen)
+{
+    const char * end = params + paramsLen;
+    while (params <= end)
+    {
+        const char * start = params;
+        int code = 0;
+        for (; params < end && *params != ';'; ++params)
+            if (*params >= '0' && *params <= '9' && code < 1000)
+                code = code * 10 + (*params - '0');
+        ++params; // past the ';'
+
+        if (code == 0) // including an empty parameter
+            *state = defaultSgrState;
+        else if (code <= 9)
+            setSgrAttr(state, code, true);
+        else if (code >= 21 && code <= 29)
+        {
+            setSgrAttr(state, code - 20, false); // 21 as for -o
+            if (code == 22) setSgrAttr(state, 1, false); // neither bold nor faint
+        }
+        else if ((code >= 30 && code <= 49) || (code >= 90 && code <= 97) || (code >= 100 && code <= 107))
+        {
+            char * color = (code < 40 || (code >= 90 && code <= 97)) ? state->fg : state->bg;
+            if (code == 38 || code == 48) // followed by 5;n or 2;r;g;b which are part of the color
+                for (int subparams = (params < end && *params == '2') ? 4 : 2; params <= end && subparams; --subparams)
+                {
+                    while (params < end && *params != ';') ++params;
+                    ++params;
+                }
+            setSgrColor(color, start, (params > end ? end : params - 1) - start);
+        }
+    }
+}
+
+// applies the code starting at esc if it is SGR, giving the end of the code
+static const char * applySgrCode(SgrState * state, const char * esc, const char * end)
+{
+    int charWidth, len = measureChar(esc, end, &charWidth);
+    if (len > 2 && esc[1] == '[' && esc[len - 1] == 'm')
+        applySgrParams(state, esc + 2, len - 3);
+    return esc + len;
+}
+
+// the change by `later` after `earlier`
+static inline SgrState composeSgrStates(const SgrState * earlier, const SgrState * later)
+{
+    if (later->reset)
+        return *later;
+    SgrState state = *earlier;
+    state.on = (earlier->on & ~later->off) | later->on;
+    state.off = (earlier->off & ~later->on) | later->off;
+    if (later->fg[0] != '\0') strcpy(state.fg, later->fg);
+    if (later->bg[0] != '\0') strcpy(state.bg, later->bg);
+    return state;
+}
+
+static bool isDefaultSgrColor(const char * color, const char * defaultCode)
+{
+    return color[0] == '\0' || strcmp(color, defaultCode) == 0;
+}
+
+// writes into buf (of at least 64 bytes) the code restoring a state from the
+// default, or nothing if none is needed, giving the length written
+static int writeSgrState(char * buf, const SgrState * state)
+{
+    char * cur = buf + 2; // after "\033[" which is written if anything follows
+    for (int code = 1; code <= 9; ++code)
+        if (state->on & (1 << code))
+        {
+            if (cur != buf + 2) *cur++ = ';';
+            *cur++ = '0' + code;
+        }
+    const char * colors[2] = {isDefaultSgrColor(state->fg, "39") ? NULL : state->fg,
+                              isDefaultSgrColor(state->bg, "49") ? NULL : state->bg};
+    for (int i = 0; i < 2; ++i)
+        if (colors[i])
+        {
+            if (cur != buf + 2) *cur++ = ';';
+            int len = strlen(colors[i]);
+            memcpy(cur, colors[i], len);
+            cur += len;
+        }
+    if (cur == buf + 2) return 0;
+    memcpy(buf, "\033[", 2);
+    *cur++ = 'm';
+    return cur - buf;
+}
+
+static void appendLineBreak(const SgrState * state)
+{
+    char code[64];
+    int codeLen = writeSgrState(code, state);
+    if (codeLen) appendToRun("\033[0m", 4);
+    appendToRun("\n", 1);
+    appendToRun(code, codeLen);
+}
+
+static int measureSpace(const char * space, const char * spaceEnd, int column) // of spaces and tabs
+{
+    for (; space < spaceEnd; ++space)
+        column = (*space == '\t') ? (column / 8 + 1) * 8 : column + 1;
+    return column;
+}
+
+int ta_wrap(char * buf, int bufLen, const char * text, int textLen, int width, bool reflow)
+{
+    startRun(buf, bufLen, runProfile(TA_PROFILE_TRUE));
+    if (width < 1)
+    {
+        snprintf(errorMsg, 128, "width should be at least 1; found: %d", width);
+        if (bufLen > 0) buf[0] = '\0';
+        setAndPrintError(errorMsg);
+        return -1;
+    }
+
+    SgrState state = defaultSgrState;
+    const char * cur = text, * end = text + (textLen < 0 ? (int)strlen(text) : textLen);
+    const char * space = NULL, * spaceEnd = NULL; // pending before the next word
+    int column = 0, charWidth;
+    while (cur < end && !runBufOverflow)
+    {
+        if (*cur == '\n')
+        {
+            const char * next = ++cur;
+            while (next < end && (*next == ' ' || *next == '\t')) ++next;
+            if (reflow && column > 0 && next < end && *next != '\n') // within a paragraph
+            {
+                space = " ";
+                spaceEnd = space + 1;
+                cur = next;
+                continue;
+            }
+            appendLineBreak(&state);
+            column = 0;
+            space = NULL;
+            continue;
+        }
+
+        if (*cur == ' ' || *cur == '\t')
+        {
+            space = cur;
+            while (cur < end && (*cur == ' ' || *cur == '\t')) ++cur;
+            spaceEnd = cur;
+            continue;
+        }
+
+        const char * word = cur;
+        int wordWidth = 0;
+        while (cur < end && *cur != ' ' && *cur != '\t' && *cur != '\n')
+            if ((ubyte)*cur > 0x20 && (ubyte)*cur < 0x7f) // fast path for printable ASCII
+            {
+                ++cur;
+                ++wordWidth;
+            }
+            else
+            {
+                cur += measureChar(cur, end, &charWidth);
+                wordWidth += charWidth;
+            }
+
+        int spaceColumn = space ? measureSpace(space, spaceEnd, column) : column;
+        if (wordWidth > 0 && column > 0 && spaceColumn + wordWidth > width)
+        {
+            appendLineBreak(&state); // the space is dropped
+            column = 0;
+        }
+        else if (space && spaceColumn <= width) // at the start of a line only for indentation
+        {
+            appendToRun(space, spaceEnd - space);
+            column = spaceColumn;
+        }
+        space = NULL;
+
+        if (column + wordWidth <= width) // as a whole
+        {
+            appendToRun(word, cur - word);
+            column += wordWidth;
+            for (const char * esc = word; (esc = (const char *)memchr(esc, '\033', cur - esc)); )
+                esc = applySgrCode(&state, esc, cur);
+            continue;
+        }
+        for (const char * next; word < cur; word = next) // split as it is longer than the width
+        {
+            next = word + measureChar(word, cur, &charWidth);
+            if (column > 0 && column + charWidth > width)
+            {
+                appendLineBreak(&state);
+                column = 0;
+            }
+            appendToRun(word, next - word);
+            column += charWidth;
+            if (*word == '\033') applySgrCode(&state, word, next);
+        }
+    }
+    return endRun(false);
+}
+
+// named styles loaded from theme files
+
+/*
+A theme file maps names to spec strings, one per line as `name = spec`, with
+blank lines and lines starting with # ignored. All specs are encoded once at
+load time for each of the output profiles, and the codes are kept in an open
+addressing hash table.
+
+The current theme is only ever replaced as a whole by an atomic store of the
+pointer to it, so readers never block and never see a partly loaded theme.
+Replaced themes are never freed since codes returned from them may still be in
+use, even kept in statics by callers. Themes are small and loads are expected
+to be rare, and replaced themes are kept on a list so that they stay reachable.
+Loads are to be done from a single thread at a time.
+*/
+typedef struct { char * name; char * codes[TA_PROFILE_AUTO]; } ThemeEntry;
+typedef struct Theme
+{
+    ThemeEntry * entries; int mask; // capacity - 1, capacity being a power of 2
+    char * fileName; struct stat fileStat;
+    struct Theme * nextReplaced;
+} Theme;
+static Theme * curTheme = NULL;
+static Theme * replacedThemes = NULL; // most recently replaced first
+
+static ThemeEntry * findThemeEntry(Theme * theme, const char * name, int nameLen)
+{
+    for (unsigned i = hashString(string(name, nameLen)); ; ++i)
+    {
+        ThemeEntry * entry = theme->entries + (i & theme->mask);
+        if (!entry->name || (areEqualN(entry->name, name, nameLen) && entry->name[nameLen] == '\0'))
+            return entry; // free slot if not found; there is always one since capacity exceeds count
+    }
+}
+
+static char * copyString(const char * data, int len)
+{
+    char * copy = (char *)malloc(len + 1);
+    memcpy(copy, data, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+static void freeTheme(Theme * theme)
+{
+    for (int i = 0; i <= theme->mask; ++i)
+        if (theme->entries[i].name)
+        {
+            free(theme->entries[i].name);
+            for (int p = 0; p < TA_PROFILE_AUTO; ++p) free(theme->entries[i].codes[p]);
+        }
+    free(theme->entries);
+    free(theme->fileName);
+    free(theme);
+}
+
+static Theme * readTheme(const char * fileName)
+{
+    FILE * themeFile = fopen(fileName, "r");
+    if (!themeFile)
+    {
+        snprintf(errorMsg, 128, "could not open theme file ‘%s’", fileName);
+        endErrorMsgOnCharBoundary();
+        return NULL;
+    }
+
+    Theme * theme = (Theme *)calloc(1, sizeof(Theme));
+    theme->fileName = copyString(fileName, strlen(fileName));
+    fstat(fileno(themeFile), &theme->fileStat);
+    int count = 0, capacity = 16;
+    theme->mask = capacity - 1;
+    theme->entries = (ThemeEntry *)calloc(capacity, sizeof(ThemeEntry));
+
+    size_t lineBufLen = 0;
+    char * lineBuf = NULL;
+    int lineNum = 0;
+    while (getline(&lineBuf, &lineBufLen, themeFile) > 0)
+    {
+        ++lineNum;
+        char * p = lineBuf;
+        while (isspace((ubyte)*p)) ++p;
+        if (*p == '\0' || *p == '#') continue;
+
+        char * equals = strchr(p, '=');
+        char * nameEnd = equals;
+        while (nameEnd && nameEnd > p && isspace((ubyte)nameEnd[-1])) --nameEnd;
+        if (!equals || nameEnd == p)
+        {
+            snprintf(errorMsg, 128, "expected ‘name = spec’ at line %d of theme file ‘%s’", lineNum, fileName);
+            endErrorMsgOnCharBoundary();
+            break;
+        }
+        char * spec = equals + 1;
+        while (isspace((ubyte)*spec)) ++spec;
+        char * specEnd = spec + strlen(spec);
+        while (specEnd > spec && isspace((ubyte)specEnd[-1])) --specEnd;
+        *specEnd = '\0';
+
+        // codes are needed irrespective of taDisabled, and errors are printed once with the line number by the caller
+        char * codes[TA_PROFILE_AUTO] = {NULL};
+        int codeCap = maxCodeLen(specEnd - spec);
+        bool encoded = true;
+        for (int profile = TA_PROFILE_AUTO - 1; profile >= 0 && encoded; --profile) // true colors first for checking errors
+        {
+            codes[profile] = (char *)malloc(codeCap);
+            encoded = encodeIntoBuf(codes[profile], codeCap, string(spec, specEnd - spec), (TaProfile)profile) >= 0;
+        }
+        if (!encoded)
+        {
+            for (int profile = 0; profile < TA_PROFILE_AUTO; ++profile) free(codes[profile]);
+            char specError[128];
+            strcpy(specError, errorMsg);
+            snprintf(errorMsg, 128, "%.*s at line %d of theme file ‘%s’",
+                     utf8PrefixLen(specError, 60), specError, lineNum, fileName);
+            endErrorMsgOnCharBoundary();
+            break;
+        }
+
+        if (2 * (count + 1) > capacity) // rehash to keep load factor under half
+        {
+            Theme old = *theme;
+            capacity *= 2;
+            theme->mask = capacity - 1;
+            theme->entries = (ThemeEntry *)calloc(capacity, sizeof(ThemeEntry));
+            for (int i = 0; i <= old.mask; ++i)
+                if (old.entries[i].name)
+                    *findThemeEntry(theme, old.entries[i].name, strlen(old.entries[i].name)) = old.entries[i];
+            free(old.entries);
+        }
+        ThemeEntry * entry = findThemeEntry(theme, p, nameEnd - p);
+        if (entry->name) // later definition overrides earlier one
+            for (int profile = 0; profile < TA_PROFILE_AUTO; ++profile) free(entry->codes[profile]);
+        else
+        {
+            entry->name = copyString(p, nameEnd - p);
+            ++count;
+        }
+        for (int profile = 0; profile < TA_PROFILE_AUTO; ++profile)
+            entry->codes[profile] = codes[profile];
+    }
+    free(lineBuf);
+    fclose(themeFile);
+
+    if (errorMsg[0])
+    {
+        freeTheme(theme);
+        return NULL;
+    }
+    return theme;
+}
+
+bool _ta_loadTheme(const char * fileName)
+{
+    errorMsg[0] = '\0';
+    taErrorMsg = errorMsg;
+    Theme * theme = readTheme(fileName);
+    if (!theme)
+    {
+        setAndPrintError(errorMsg);
+        return false; // current theme, if any, is retained
+    }
+    Theme * replaced = __atomic_exchange_n(&curTheme, theme, __ATOMIC_ACQ_REL);
+    if (replaced)
+    {
+        replaced->nextReplaced = replacedThemes;
+        replacedThemes = replaced;
+    }
+    return true;
+}
+
+bool _ta_reloadTheme(bool onlyIfChanged)
+{
+    errorMsg[0] = '\0';
+    taErrorMsg = errorMsg;
+    Theme * theme = __atomic_load_n(&curTheme, __ATOMIC_ACQUIRE);
+    if (!theme)
+    {
+        setAndPrintError("no theme has been loaded");
+        return false;
+    }
+    if (onlyIfChanged)
+    {
+        struct stat fileStat;
+        if (stat(theme->fileName, &fileStat) == 0 &&
+            fileStat.st_mtime == theme->fileStat.st_mtime && fileStat.st_size == theme->fileStat.st_size &&
+            fileStat.st_ino == theme->fileStat.st_ino)
+            return true; // unchanged
+    }
+    return _ta_loadTheme(theme->fileName);
+}
+
+static const char * getStyle(const char * name, TaProfile profile)
+// profile should be already resolved
+{
+    if (taDisabled || profile == TA_PROFILE_NONE)
+        return "";
+    Theme * theme = __atomic_load_n(&curTheme, __ATOMIC_ACQUIRE);
+    ThemeEntry * entry = theme ? findThemeEntry(theme, name, strlen(name)) : NULL;
+    if (!entry || !entry->name)
+    {
+        snprintf(errorMsg, 128, theme ? "style not found in theme: ‘%s’" : "no theme has been loaded for style: ‘%s’", name);
+        return setAndPrintError(errorMsg);
+    }
+    TA_STAT(++threadStats()->styleHits);
+    return entry->codes[profile];
+}
+
+const char * _ta_style(const char * name)
+{
+    errorMsg[0] = '\0'; // clear error message always
+    taErrorMsg = errorMsg;
+    return getStyle(name, resolveProfile(taProfile, STDOUT_FILENO));
+}
+
+#ifndef TA_CPP
+static const char * getAtCode(const char * str, TaProfile profile)
+// for the @spec and @:name arguments of tawrite; profile should be already resolved
+{
+    if (str[1] != ':')
+        return _ta_np(str + 1, -1, profile);
+    errorMsg[0] = '\0';
+    taErrorMsg = errorMsg;
+    return getStyle(str + 2, profile);
+}
+#endif
+
+#if !defined(TA_EXEC) && !defined(TA_CPP)
+// when compiling the C library
+void _tafwrite(FILE * ofile, ...)
+{
+    va_list args;
+    va_start(args, ofile);
+    const char * str; //, * codeSeq
+    TaProfile profile = resolveProfile(taProfile, fileno(ofile)); // per stream
+    while (true)
+    {
+        str = va_arg(args, const char *);
+        if (str == NULL) break;
+        fputs((str[0] == '@' && str[1] != '\0') ? getAtCode(str, profile) : str, ofile);
+    }
+    va_end(args);
+}
+#endif
+
+#ifdef TA_EXEC
+// when compiling the executable
+int main(int argc, char * argv[])
+{
+    int progNameLen = strlen(argv[0]);
+    bool codeRequired = progNameLen > 5 && areEqualN(argv[0] + progNameLen - 5, "-code", 5);
+
+    taStderr = stderr;
+    if (getenv("TA_DISABLED") && !codeRequired)
+        taDisabled = true;
+
+    const char * profileName = getenv("TA_PROFILE");
+    if (profileName && !codeRequired)
+    {
+        static const char profileNames[][10] = {"none", "16", "256", "truecolor", "auto"}; // no relocations
+        int i;
+        for (i = 0; i < 5; ++i)
+            if (strcmp(profileName, profileNames[i]) == 0) break;
+        if (i == 5)
+        {
+            setAndPrintError("TA_PROFILE should be one of none, 16, 256, truecolor or auto");
+            return EXIT_FAILURE;
+        }
+        taProfile = (TaProfile)i;
+        // output is usually captured by command substitution, so only the environment is consulted
+        if (taProfile == TA_PROFILE_AUTO)
+            taProfile = taDetectProfile(-1);
+        if (taProfile == TA_PROFILE_NONE)
+            taDisabled = true;
+    }
+
+    const char * themeFileName = getenv("TA_THEME");
+    if (themeFileName && !_ta_loadTheme(themeFileName))
+        return EXIT_FAILURE; // error message would have been printed to stderr
+
+    if (progNameLen > 5 && areEqualN(argv[0] + progNameLen - 5, "write", 5))
+    // invoked as tawrite
+    {
+        for (int i = 1; i < argc; ++i)
+        {
+            char * arg;
+            arg = argv[i];
+            if (areEqualN(arg, "\\n", 2)) // for convenience and parity with library functions
+                putchar('\n');
+            else
+                fputs((arg[0] == '@' && arg[1] != '\0') ? getAtCode(arg, taProfile) : arg, stdout);
+        }
+    }
+    else
+    // invoked as ta or ta-code
+    if (!taDisabled)
+    {
+        if (argc < 2) // one program name plus arguments
+        {
+            setAndPrintError("at least 1 argument should be given");
+            return EXIT_FAILURE;
+        }
+
+        // each argument is a spec
+        curProfile = taProfile;
+        startCodeSeq();
+        appendToRun("\033[", 2);
+        bool success = true;
+        for (int i = 1; i < argc && success; ++i)
+            success = appendSpecCode(string(argv[i], strlen(argv[i])), i == 1);
+        if (success) appendToRun("m", 1);
+        const char * codeSeq = endCodeSeq(success);
+        if (codeSeq[0] == '\0') return EXIT_FAILURE; // error message would have been printed to stderr
+
+        if (codeRequired)
+            printf("\\033%s\n", codeSeq + 1); // except first i.e. esc char
+        else
+            fputs(codeSeq, stdout);
+    }
+
+    return EXIT_SUCCESS;
+}
+#endif // TA_EXEC
+#endif // TEXTATTR_IMPLEMENTATION
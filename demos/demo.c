@@ -58,6 +58,30 @@ void helper()
     fclose(tempFile);
     tawrite("Printed text to ", taWhite, tempFileName, taOff, "; please check it.\n");
 
+    // ta_gradient and ta_heatmap demo
+    use("ta_gradient");
+    unsigned char rgb[3 * 64];
+    for (int i = 0; i < 64; ++i)
+        { rgb[3 * i] = 255 - 4 * i; rgb[3 * i + 1] = 4 * i; rgb[3 * i + 2] = 128; }
+    char run[2048]; // be sure to allocate enough space; -1 is returned otherwise
+    if (ta_gradient(run, sizeof run, rgb, NULL, 64, true, taProfile) >= 0)
+        printf("%s\n", run);
+    use("ta_heatmap");
+    const char * palette[] = {"/^005", "/^015", "/^055", "/^050", "/^550", "/^530", "/^500"};
+    const char * cells[] = {"M", "o", "n", "T", "u", "e", "W", "e", "d", "T", "h", "u", "F", "r", "i", "S", "a", "S", "u"};
+    float latencies[] = {3, 4, 2, 8, 15, 9, 4, 3, 2, 5, 11, 25, 30, 22, 14, 7, 3, 1, 2};
+    if (ta_heatmap(run, sizeof run, palette, 7, latencies, 0, 30, cells, 19, taProfile) >= 0)
+        printf("%s\n", run);
+
+    // ta_wrap demo
+    use("ta_wrap");
+    char text[512];
+    snprintf(text, sizeof text, "%sReflowed%s to 40 columns, the %scolors and attributes in effect are\n"
+                                "restored%s on each continuation line and reset at the end of each line.",
+                                ta("+c o"), ta("f"), ta("y u"), ta("f"));
+    if (ta_wrap(run, sizeof run, text, -1, 40, true) >= 0)
+        printf("%s\n", run);
+
     NEWL;
 }
 
@@ -23,8 +23,8 @@ int main()
     // They will just be output as-is (as they do not begin with @) and give the same effect.
 
     // TextAttrError-s will be thrown if input attribute specs are faulty:
-    const char * badSpecs [] = {"", "c /r m /g y /b k /l c /r m /g y /b k /l", "longerThanAnyValidSpec", "q", "^610", "%ghijkl", "a50"};
-    for (int i = 0; i < 7; ++i)
+    const char * badSpecs [] = {"", "q", "/q", "^610", "%ghijkl", "a50"};
+    for (int i = 0; i < 6; ++i)
     {
         try { ta(badSpecs[i]); }
         catch (TextAttrError & e) { std::cout << e.what() << std::endl; }
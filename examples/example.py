@@ -21,7 +21,7 @@ tawrite("@g i u", "text", "@w", "attr", "@off", " tries to be helpful by providi
 # They will just be output as-is (as they do not begin with @) and give the same effect.
 
 # TextAttrError-s will be thrown if input attribute specs are faulty:
-badSpecs = ("", "c /r m /g y /b k /l c /r m /g y /b k /l", "longerThanAnyValidSpec", "q", "^610", "%ghijkl", "a50")
+badSpecs = ("", "q", "/q", "^610", "%ghijkl", "a50")
 for badSpec in badSpecs:
     try:
         ta(badSpec)
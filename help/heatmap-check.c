@@ -0,0 +1,62 @@
+// Checks ta_heatmap against ta_encode for palettes of specs of every length
+// from a single spec to hundreds of them, whose codes are far beyond the 64
+// bytes of a cycling buffer, and for more palette specs than there are cells.
+// Mismatches are printed and the exit status is failure if there are any.
+
+#include "textattr.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char * const specs[] = {"%ff8000", "/%0080ff", "^123", "/a17", "o", "not-u", "+r!", "/light-cyan"};
+#define specCount (int)(sizeof specs / sizeof specs[0])
+
+static int checked, mismatches;
+
+static void check(const char * const * palette, int paletteLen, int cellCount)
+{
+    static char expected[1 << 20], run[1 << 20], code[1 << 16];
+    static float samples[64];
+    static const char * cells[64];
+    ++checked;
+    int len = 0;
+    for (int i = 0; i < cellCount; ++i)
+    {
+        samples[i] = (float)(i * 7 % paletteLen);
+        cells[i] = (i % 2) ? "#" : "--";
+        if (i == 0 || samples[i] != samples[i - 1])
+        {
+            int codeLen = ta_encode(code, sizeof code, palette[(int)samples[i]], -1, TA_PROFILE_TRUE);
+            memcpy(expected + len, code, codeLen);
+            len += codeLen;
+        }
+        len += sprintf(expected + len, "%s", cells[i]);
+    }
+    if (cellCount > 0) len += sprintf(expected + len, "\033[0m");
+
+    int runLen = ta_heatmap(run, sizeof run, palette, paletteLen, samples, 0, paletteLen, cells, cellCount, TA_PROFILE_TRUE);
+    if (runLen == len && memcmp(run, expected, len) == 0) return;
+    if (++mismatches <= 20)
+        printf("palette of %d specs (first of length %d) over %d cells: got length %d instead of %d\n",
+               paletteLen, (int)strlen(palette[0]), cellCount, runLen, len);
+}
+
+int main()
+{
+    static char specStrings[16][1 << 13];
+    const char * palette[16];
+    for (int p = 0; p < 16; ++p) // spec strings of p * 37 + 1 specs, cycling through the specs above
+    {
+        char * s = specStrings[p];
+        s[0] = '\0';
+        for (int i = 0; i < p * 37 + 1; ++i)
+            sprintf(s + strlen(s), "%s%s", i ? " " : "", specs[(p + i) % specCount]);
+        palette[p] = s;
+    }
+    for (int paletteLen = 1; paletteLen <= 16; ++paletteLen)
+        for (int cellCount = 0; cellCount <= 64; cellCount += 9)
+            check(palette + 16 - paletteLen, paletteLen, cellCount);
+
+    printf("heatmap check: %d of %d runs mismatched\n", mismatches, checked);
+    return mismatches ? EXIT_FAILURE : EXIT_SUCCESS;
+}
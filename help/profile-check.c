@@ -0,0 +1,81 @@
+// Checks the codes for 16 colors against a brute-force search for the nearest
+// of the 16 named colors (by their VGA values, as in ta2html), for a sample of
+// RGB colors given as %rrggbb and /%rrggbb, and as the cells of a gradient.
+// Mismatches are printed and the exit status is failure if there are any.
+
+#include "textattr.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const int vga[16][3] = {
+    {0x00, 0x00, 0x00}, {0xaa, 0x00, 0x00}, {0x00, 0xaa, 0x00}, {0xaa, 0x55, 0x00},
+    {0x00, 0x00, 0xaa}, {0xaa, 0x00, 0xaa}, {0x00, 0xaa, 0xaa}, {0xaa, 0xaa, 0xaa},
+    {0x55, 0x55, 0x55}, {0xff, 0x55, 0x55}, {0x55, 0xff, 0x55}, {0xff, 0xff, 0x55},
+    {0x55, 0x55, 0xff}, {0xff, 0x55, 0xff}, {0x55, 0xff, 0xff}, {0xff, 0xff, 0xff},
+};
+
+static int checked, mismatches;
+
+static int nearestCode(int r, int g, int b, bool bkgd)
+{
+    int best = 0, bestDist = 3 * 256 * 256;
+    for (int i = 0; i < 16; ++i)
+    {
+        int dr = r - vga[i][0], dg = g - vga[i][1], db = b - vga[i][2];
+        int dist = dr * dr + dg * dg + db * db;
+        if (dist < bestDist) { best = i; bestDist = dist; }
+    }
+    return (best < 8 ? 30 + best : 90 + best - 8) + (bkgd ? 10 : 0);
+}
+
+static void check(int r, int g, int b, bool bkgd)
+{
+    char spec[16], code[64], expected[64];
+    ++checked;
+    snprintf(spec, sizeof spec, "%s%%%02x%02x%02x", bkgd ? "/" : "", r, g, b);
+    snprintf(expected, sizeof expected, "\033[%dm", nearestCode(r, g, b, bkgd));
+    if (ta_encode(code, sizeof code, spec, -1, TA_PROFILE_16) >= 0 && strcmp(code, expected) == 0) return;
+    if (++mismatches <= 20)
+        printf("‘%s’: got ‘\\033%s’ instead of ‘\\033%s’\n", spec, code + 1, expected + 1);
+}
+
+#define sampleCount (52 * 52 * 52)
+
+static void checkGradient(const unsigned char * rgb, bool bkgd)
+{
+    static char expected[sampleCount * 8], run[sampleCount * 8];
+    ++checked;
+    int len = 0, prevCode = -1;
+    for (int i = 0; i < sampleCount; ++i)
+    {
+        int code = nearestCode(rgb[3 * i], rgb[3 * i + 1], rgb[3 * i + 2], bkgd);
+        if (code != prevCode) len += sprintf(expected + len, "\033[%dm", code);
+        prevCode = code;
+        expected[len++] = ' ';
+    }
+    len += sprintf(expected + len, "\033[0m");
+
+    int runLen = ta_gradient(run, sizeof run, rgb, NULL, sampleCount, bkgd, TA_PROFILE_16);
+    if (runLen == len && memcmp(run, expected, len) == 0) return;
+    if (++mismatches <= 20)
+        printf("gradient of %d colors: got length %d instead of %d\n", sampleCount, runLen, len);
+}
+
+int main()
+{
+    static unsigned char rgb[sampleCount * 3];
+    int n = 0;
+    for (int r = 0; r < 256; r += 5)
+        for (int g = 0; g < 256; g += 5)
+            for (int b = 0; b < 256; b += 5)
+            {
+                check(r, g, b, (r + g + b) % 2);
+                rgb[n++] = r; rgb[n++] = g; rgb[n++] = b;
+            }
+    checkGradient(rgb, false);
+    checkGradient(rgb, true);
+
+    printf("profile check: %d of %d colors and gradients mismatched\n", mismatches, checked);
+    return mismatches ? EXIT_FAILURE : EXIT_SUCCESS;
+}
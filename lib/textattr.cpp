@@ -11,12 +11,32 @@
 
 #include "textattr.hpp"
 
-tastream ta_cout(std::cout);
-tastream ta_cerr(std::cerr);
+tastream ta_cout(std::cout, 1);
+tastream ta_cerr(std::cerr, 2);
+
+#define TA_CPP
+#include "textattr.c"
+
+static void throwIfError()
+{
+    if (taErrorMsg && taErrorMsg[0])
+        throw TextAttrError(taErrorMsg);
+}
 
 template<> tastream & tastream::operator<<(const char * s)
 {
-    _os << ((s[0] == '@' && s[1] != '\0') ? ta(s + 1) : s);
+    if (s[0] != '@' || s[1] == '\0')
+        _os << s;
+    else if (s[1] == ':' && s[2] != '\0')
+    {
+        errorMsg[0] = '\0';
+        taErrorMsg = errorMsg;
+        const char * code = getStyle(s + 2, resolveProfile(taProfile, _fd));
+        throwIfError();
+        _os << code;
+    }
+    else
+        _os << ta_p(s + 1, resolveProfile(taProfile, _fd));
     return *this;
 }
 
@@ -25,13 +45,33 @@ template<> tastream & tastream::operator<<(std::string s)
     return *this << s.c_str(); // delegate to preceding function
 }
 
-#define TA_CPP
-#include "textattr.c"
-
 const char * _ta_n_cpp(const char * specString, int specStringLen)
 {
-    const char * codeSeq = _ta_n(specString, specStringLen);
-    if (taErrorMsg && taErrorMsg[0])
-        throw TextAttrError(taErrorMsg);
+    return _ta_np_cpp(specString, specStringLen, taProfile);
+}
+
+const char * _ta_np_cpp(const char * specString, int specStringLen, TaProfile profile)
+{
+    const char * codeSeq = _ta_np(specString, specStringLen, profile);
+    throwIfError();
     return codeSeq;
 }
+
+void _ta_loadTheme_cpp(const char * fileName)
+{
+    _ta_loadTheme(fileName);
+    throwIfError();
+}
+
+void _ta_reloadTheme_cpp(bool onlyIfChanged)
+{
+    _ta_reloadTheme(onlyIfChanged);
+    throwIfError();
+}
+
+const char * _ta_style_cpp(const char * name)
+{
+    const char * code = _ta_style(name);
+    throwIfError();
+    return code;
+}
@@ -15,22 +15,127 @@
 #include <stdio.h>
 #include <stdbool.h>
 
+// types
+
+typedef enum { TA_PROFILE_NONE, TA_PROFILE_16, TA_PROFILE_256, TA_PROFILE_TRUE, TA_PROFILE_AUTO } TaProfile;
+
 // functions
 
 // next two lines needed because internal function cannot be named as ta_n
 // due to clash with and use by C++ ta_n which throws
 const char * _ta_n(const char * specString, int specStringLen);
+#if !defined(TA_STATS) && !defined(TA_NO_INLINE)
+#define ta_n _ta_n_inline // see below
+#define ta(SPEC_STRING) _ta_n_inline(SPEC_STRING, -1)
+#else
 #define ta_n _ta_n
 #define ta(SPEC_STRING) _ta_n(SPEC_STRING, -1)
+#endif
+
+// for encoding with a specific output profile instead of taProfile
+const char * _ta_np(const char * specString, int specStringLen, TaProfile profile);
+#define ta_np _ta_np
+#define ta_p(SPEC_STRING, PROFILE) _ta_np(SPEC_STRING, -1, PROFILE)
+
+// detects the profile supported by the terminal at fd (result is cached)
+TaProfile taDetectProfile(int fd);
+
+// named styles from a theme file of lines of the form `name = spec`; the
+// reload is done only if the file has changed since loading if so requested;
+// codes of a replaced theme stay valid as it is never freed
+bool _ta_loadTheme(const char * fileName);
+bool _ta_reloadTheme(bool onlyIfChanged);
+const char * _ta_style(const char * name);
+#define ta_loadTheme _ta_loadTheme
+#define ta_reloadTheme _ta_reloadTheme
+#define ta_style _ta_style
+
+// encodes the spec string into buf instead of a cycling buffer, without any
+// limit on its length; returns the length written, or -1 on error such as buf
+// being too small
+int ta_encode(char * buf, int bufLen, const char * specString, int specStringLen, TaProfile profile);
+
+// writes cellCount cells of text (spaces if cellTexts is NULL) into buf colored
+// by 3 bytes of RGB per cell or by one of the palette specs as per the sample;
+// the palette is encoded afresh on each call into memory of that call, so no
+// palette state is shared between calls; returns the length written, or -1 on
+// error such as buf being too small
+int ta_gradient(char * buf, int bufLen, const unsigned char * rgb,
+                const char * const * cellTexts, int cellCount, bool bkgd, TaProfile profile);
+int ta_heatmap(char * buf, int bufLen, const char * const * palette, int paletteLen,
+               const float * samples, float minSample, float maxSample,
+               const char * const * cellTexts, int cellCount, TaProfile profile);
+
+// wraps text (which may have escape codes) to lines of at most width columns,
+// breaking at whitespace or within longer words, and if reflow, first joining
+// the lines of each paragraph; the colors and attributes in effect are reset at
+// the end of each line and restored at the start of the next; returns the
+// length written, or -1 on error such as buf being too small
+int ta_wrap(char * buf, int bufLen, const char * text, int textLen, int width, bool reflow);
 
 #define tawrite(...)        _tafwrite(stdout, __VA_ARGS__, NULL)
 #define tafwrite(FILE, ...) _tafwrite(FILE,   __VA_ARGS__, NULL)
 void _tafwrite(FILE * ofile, ...);
 
+#ifdef TA_STATS
+// runtime statistics, available when compiled with TA_STATS defined
+
+typedef enum
+{
+    TA_ERROR_EMPTY_SPEC, TA_ERROR_NO_SPECS, TA_ERROR_UNRECOGNIZED,
+    TA_ERROR_RGB_LIMITED, TA_ERROR_RGB_TRUE, TA_ERROR_GRAY, TA_ERROR_OTHER, TA_ERROR_KINDS
+} TaErrorKind;
+
+#define TA_STATS_LATENCY_BUCKETS 24 // bucket i counts latencies below 2 ^ i ns, the last one all beyond
+#define TA_STATS_SPEC_LEN 48        // longer specs are truncated in the top specs report
+
+typedef struct
+{
+    unsigned long long calls, disabled, shortcuts, cacheHits, styleHits; // disabled includes profile none
+    unsigned long long errors[TA_ERROR_KINDS];
+    unsigned long long latency[TA_STATS_LATENCY_BUCKETS];   // only if taStatsLatency
+} TaStats;
+typedef struct { char spec[TA_STATS_SPEC_LEN]; unsigned long long count; } TaSpecCount;
+typedef void (* TaTraceHook)(const char * specString, int specStringLen, const char * codeSeq,
+                             long long latencyNs, void * userData);
+
+void ta_stats(TaStats * stats);               // sums of the counters of all threads
+void ta_resetStats();
+int ta_topSpecs(TaSpecCount * specs, int n);  // most frequent specs if taStatsTopSpecs; returns count filled
+void ta_setTraceHook(TaTraceHook hook, void * userData); // called after each encoding; NULL to remove
+
+extern bool taStatsLatency, taStatsTopSpecs;
+#endif // TA_STATS
+
 // variables
 
 extern bool taDisabled;
 extern const char * taErrorMsg;
 extern FILE * taStderr;
+extern TaProfile taProfile;
+
+// inline fast path
+
+/*
+Unless TA_STATS (which counts these cases) or TA_NO_INLINE is defined, the
+checks for taDisabled and the frequent spec "f" are done inline, so that the
+compiler can fold them away for literal specs without any call to the library.
+*/
+#if !defined(TA_STATS) && !defined(TA_NO_INLINE)
+static inline const char * _ta_n_inline(const char * specString, int specStringLen)
+{
+    if (taDisabled || taProfile == TA_PROFILE_NONE)
+    {
+        taErrorMsg = ""; // clear error message always
+        return "";
+    }
+    if (taProfile != TA_PROFILE_AUTO && specString[0] == 'f' && (specStringLen == 1 || specString[1] == '\0'))
+    {
+        taErrorMsg = "";
+        return "\033[0m";
+    }
+    return _ta_n(specString, specStringLen);
+}
+#endif
 
 #endif // TEXTATTR_H
@@ -15,6 +15,10 @@
 #include <stdexcept>
 #include <iostream>
 
+// types
+
+typedef enum { TA_PROFILE_NONE, TA_PROFILE_16, TA_PROFILE_256, TA_PROFILE_TRUE, TA_PROFILE_AUTO } TaProfile;
+
 // classes
 
 class TextAttrError : public std::invalid_argument
@@ -26,11 +30,12 @@ public:
 class tastream
 {
 public:
-    tastream(std::ostream & os) : _os(os) {}
+    tastream(std::ostream & os, int fd = -1) : _os(os), _fd(fd) {} // fd is for detecting the profile
     template<typename T> tastream & operator << (T val) { _os << val; return *this; }
     tastream & operator<<(std::ostream & (*manipulator)(std::ostream &)) { manipulator(_os); return *this; }
 private:
     std::ostream & _os;
+    int _fd;
 };
 
 template<> tastream & tastream::operator<<(const char * s);
@@ -38,15 +43,93 @@ template<> tastream & tastream::operator<<(std::string s);
 
 extern tastream ta_cout, ta_cerr;
 
+#ifdef TA_STATS
+// runtime statistics, available when compiled with TA_STATS defined
+
+typedef enum
+{
+    TA_ERROR_EMPTY_SPEC, TA_ERROR_NO_SPECS, TA_ERROR_UNRECOGNIZED,
+    TA_ERROR_RGB_LIMITED, TA_ERROR_RGB_TRUE, TA_ERROR_GRAY, TA_ERROR_OTHER, TA_ERROR_KINDS
+} TaErrorKind;
+
+#define TA_STATS_LATENCY_BUCKETS 24 // bucket i counts latencies below 2 ^ i ns, the last one all beyond
+#define TA_STATS_SPEC_LEN 48        // longer specs are truncated in the top specs report
+
+typedef struct
+{
+    unsigned long long calls, disabled, shortcuts, cacheHits, styleHits; // disabled includes profile none
+    unsigned long long errors[TA_ERROR_KINDS];
+    unsigned long long latency[TA_STATS_LATENCY_BUCKETS];   // only if taStatsLatency
+} TaStats;
+typedef struct { char spec[TA_STATS_SPEC_LEN]; unsigned long long count; } TaSpecCount;
+typedef void (* TaTraceHook)(const char * specString, int specStringLen, const char * codeSeq,
+                             long long latencyNs, void * userData);
+
+void ta_stats(TaStats * stats);               // sums of the counters of all threads
+void ta_resetStats();
+int ta_topSpecs(TaSpecCount * specs, int n);  // most frequent specs if taStatsTopSpecs; returns count filled
+void ta_setTraceHook(TaTraceHook hook, void * userData); // called after each encoding; NULL to remove
+
+extern bool taStatsLatency, taStatsTopSpecs;
+#endif // TA_STATS
+
 // variable
 
 extern bool taDisabled;
-//extern const char * taErrorMsg;
+extern TaProfile taProfile;
+extern const char * taErrorMsg;
 
 // functions
 
 const char * _ta_n_cpp(const char * specString, int specStringLen);
+#if !defined(TA_STATS) && !defined(TA_NO_INLINE)
+#define ta_n _ta_n_cpp_inline // see below
+#define ta(SPEC_STRING) _ta_n_cpp_inline(SPEC_STRING, -1)
+#else
 #define ta_n _ta_n_cpp
 #define ta(SPEC_STRING) _ta_n_cpp(SPEC_STRING, -1)
+#endif
+
+const char * _ta_np_cpp(const char * specString, int specStringLen, TaProfile profile);
+#define ta_np _ta_np_cpp
+#define ta_p(SPEC_STRING, PROFILE) _ta_np_cpp(SPEC_STRING, -1, PROFILE)
+
+TaProfile taDetectProfile(int fd);
+
+void _ta_loadTheme_cpp(const char * fileName);
+void _ta_reloadTheme_cpp(bool onlyIfChanged);
+const char * _ta_style_cpp(const char * name);
+#define ta_loadTheme _ta_loadTheme_cpp
+#define ta_reloadTheme _ta_reloadTheme_cpp
+#define ta_style _ta_style_cpp
+
+// these do not throw but return -1 with the error message in taErrorMsg;
+// ta_encode encodes into buf instead of a cycling buffer
+int ta_encode(char * buf, int bufLen, const char * specString, int specStringLen, TaProfile profile);
+int ta_gradient(char * buf, int bufLen, const unsigned char * rgb,
+                const char * const * cellTexts, int cellCount, bool bkgd, TaProfile profile);
+int ta_heatmap(char * buf, int bufLen, const char * const * palette, int paletteLen,
+               const float * samples, float minSample, float maxSample,
+               const char * const * cellTexts, int cellCount, TaProfile profile);
+int ta_wrap(char * buf, int bufLen, const char * text, int textLen, int width, bool reflow);
+
+// inline fast path as in textattr.h
+
+#if !defined(TA_STATS) && !defined(TA_NO_INLINE)
+static inline const char * _ta_n_cpp_inline(const char * specString, int specStringLen)
+{
+    if (taDisabled || taProfile == TA_PROFILE_NONE)
+    {
+        taErrorMsg = ""; // clear error message always
+        return "";
+    }
+    if (taProfile != TA_PROFILE_AUTO && specString[0] == 'f' && (specStringLen == 1 || specString[1] == '\0'))
+    {
+        taErrorMsg = "";
+        return "\033[0m";
+    }
+    return _ta_n_cpp(specString, specStringLen);
+}
+#endif
 
 #endif // TEXTATTR_HPP
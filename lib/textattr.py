@@ -9,13 +9,26 @@
 # Use, modification and distribution are permitted subject to the
 # "BSD-2-Clause"-type license stated in the accompanying file LICENSE.txt
 
-__all__ = ["ta", "tawrite", "taDisabled", "TextAttrError"]
+__all__ = ["ta", "tawrite", "taDisabled", "taProfile", "TextAttrError",
+           "ta_style", "ta_loadTheme", "ta_reloadTheme",
+           "TA_PROFILE_NONE", "TA_PROFILE_16", "TA_PROFILE_256", "TA_PROFILE_TRUE", "TA_PROFILE_AUTO"]
 
-from ctypes import CDLL, c_char_p
+from ctypes import CDLL, c_bool, c_char_p, c_int
 _lib = CDLL("libta.so")
 _ta_n = _lib._ta_n
 _ta_n.argtypes = [c_char_p]
 _ta_n.restype = c_char_p
+_ta_style = _lib._ta_style
+_ta_style.argtypes = [c_char_p]
+_ta_style.restype = c_char_p
+_lib._ta_loadTheme.argtypes = [c_char_p]
+_lib._ta_loadTheme.restype = c_bool
+_lib._ta_reloadTheme.argtypes = [c_bool]
+_lib._ta_reloadTheme.restype = c_bool
+
+def _errorMsg():
+    errorMsg = c_char_p.in_dll(_lib, "taErrorMsg").value
+    return errorMsg.decode() if errorMsg else ""
 
 class TextAttrError(ValueError):
     pass
@@ -28,11 +41,21 @@ def taDisabled(val):
         raise TypeError("argument to ‘taDisabled’ should be of type bool")
     _taDisabled = val
 
+TA_PROFILE_NONE, TA_PROFILE_16, TA_PROFILE_256, TA_PROFILE_TRUE, TA_PROFILE_AUTO = range(5)
+_taProfile = TA_PROFILE_TRUE
+
+def taProfile(val):
+    global _taProfile
+    if type(val) is not int or not TA_PROFILE_NONE <= val <= TA_PROFILE_AUTO:
+        raise TypeError("argument to ‘taProfile’ should be one of the TA_PROFILE_* constants")
+    c_int.in_dll(_lib, "taProfile").value = val
+    _taProfile = val
+
 def ta(specString):
 
     if _taDisabled:
         return ""  # NOTE: not checking for errors
-    if specString == "f":
+    if specString == "f" and _taProfile == TA_PROFILE_TRUE:
         return "\033[0m"  # frequent use
 
     t = type(specString)
@@ -45,12 +68,30 @@ def ta(specString):
 
     codeSeq = _ta_n(specString, len(specString))
     if codeSeq == b"":
-        raise TextAttrError(c_char_p.in_dll(_lib, "taErrorMsg").value.decode())
+        if _errorMsg():
+            raise TextAttrError(_errorMsg())
+        return ""  # as per profile
     return codeSeq.decode()
     # NOTE: .decode() above is unnecessary as far as a terminal is concerned since
     # anyhow it has to be provided encoded bytes in the end. However, without it, print()
     # runs str() on the bytes object and produces undesired output as b'\x1b[...'
 
+def ta_loadTheme(fileName):
+    if not _lib._ta_loadTheme(fileName.encode()):
+        raise TextAttrError(_errorMsg())
+
+def ta_reloadTheme(onlyIfChanged = False):
+    if not _lib._ta_reloadTheme(onlyIfChanged):
+        raise TextAttrError(_errorMsg())
+
+def ta_style(name):
+    if _taDisabled:
+        return ""
+    code = _ta_style(name.encode())
+    if _errorMsg():
+        raise TextAttrError(_errorMsg())
+    return code.decode()
+
 def tawrite(*args, **kwargs):
 
     import sys
@@ -63,7 +104,9 @@ def tawrite(*args, **kwargs):
 
     write = _file.write
     for arg in args:
-        if type(arg) is str and len(arg) > 1 and arg[0] == "@":
+        if type(arg) is str and len(arg) > 2 and arg[:2] == "@:":
+            write(ta_style(arg[2:]))
+        elif type(arg) is str and len(arg) > 1 and arg[0] == "@":
             write(ta(arg[1:]))
         else:
             write(str(arg))
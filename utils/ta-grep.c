@@ -0,0 +1,553 @@
+// ta-grep
+// =======
+//
+// Searches text with ANSI color and attribute escape codes by its visible text
+// and prints the matching lines with their original colors and attributes
+//
+// Copyright (C) 2018, Shriramana Sharma, samjnaa-at-gmail-dot-com
+//
+// Use, modification and distribution are permitted subject to the
+// "BSD-2-Clause"-type license stated in the accompanying file LICENSE.txt
+
+/*
+Patterns are matched against the text with the escape sequences removed, so a
+match may span a change of color or attribute. The colors and attributes in
+effect at the start of each printed line are restored by a single code before
+it, and reset after it, so that each line is shown as it would be in context.
+
+Files are memory-mapped and split into chunks at line boundaries which are
+searched in parallel. Runs of lines without escape sequences are searched as a
+whole by memmem (for literal patterns) or regexec, as grep does, and the other
+lines are stripped of them a block at a time and the block searched as a whole.
+Each chunk records the change in state (see SgrState in textattr.c, which is
+included here) from its start to each of its matching lines and to its end, so
+that the state at its start need not be known while searching and is composed
+in order afterwards.
+*/
+
+#define _GNU_SOURCE // for memmem
+#include "textattr.c" // the library itself, sharing its SGR state tracking (SgrState) with ta_wrap
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <regex.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const SgrState noSgrChange = {false, 0, 0, "", ""};
+
+//
+// matching
+
+static bool fixedString = false, extendedRegex = false, ignoreCase = false, invertMatch = false,
+            lineNumbers = false, countOnly = false;
+static const char * pattern;
+static size_t patternLen;
+static regex_t regex;
+
+// finds the first match in text which consists of whole lines, giving its offset
+static bool findMatch(const char * text, size_t textLen, size_t * matchAt)
+{
+    if (fixedString)
+    {
+        const char * match = memmem(text, textLen, pattern, patternLen);
+        if (match) *matchAt = match - text;
+        return match != NULL;
+    }
+    regmatch_t match = {0, textLen};
+    if (regexec(&regex, text, 1, &match, REG_STARTEND) != 0)
+        return false;
+    *matchAt = match.rm_so;
+    return true;
+}
+
+//
+// searching a chunk
+
+typedef struct
+{
+    size_t start, len, lineNum;
+    SgrState state, endState; // changes from the start of the chunk to the start and end of the line
+} Match;
+
+typedef struct
+{
+    const char * line;
+    size_t visible;          // offset in the stripped text
+    const char * lastReset;  // see below
+} LineStart;
+
+/*
+The state is needed only at the lines to be printed and at the end of a chunk.
+So while stripping, only the end of the last plain reset ("\033[0m" or "\033[m",
+which most colored text is full of) is noted, and the state is brought up to a
+line to be printed by applying the SGR sequences from there, or from where it
+was last brought up to if that is later, so that none is applied twice.
+*/
+typedef struct
+{
+    const char * start, * end; // start is at the start of a line
+    Match * matches;
+    size_t matchCount, matchCap, lineCount;
+    SgrState state;            // change from the start to `replayed`
+    const char * replayed, * lastReset;
+    char * visible;            // scratch buffer for a block of lines without their escape sequences
+    size_t visibleCap;
+    LineStart * lineStarts;    // of the lines in the block
+    size_t lineStartCap;
+    bool threaded, failed;
+} Chunk;
+
+static size_t countLines(const char * start, const char * end)
+{
+    size_t count = 0;
+    while ((start = memchr(start, '\n', end - start)))
+        ++start, ++count;
+    return count;
+}
+
+static const char * lineEnd(const char * line, const char * end)
+{
+    const char * eol = memchr(line, '\n', end - line);
+    return eol ? eol : end;
+}
+
+// gives the end of the escape sequence starting at esc as measured for ta_wrap:
+// a control sequence, an operating system command such as a hyperlink, or the
+// escape char with any intermediate bytes and a final byte, as of "\033(B"; for
+// a control sequence also gives its parameters and final byte, which is otherwise 0
+static const char * skipEscape(const char * esc, const char * end, const char ** params, char * final)
+{
+    int width;
+    const char * next = esc + measureChar(esc, end, &width);
+    *final = 0;
+    if (next - esc > 2 && esc[1] == '[' && next[-1] >= 0x40 && next[-1] <= 0x7e)
+    {
+        *params = esc + 2;
+        *final = next[-1];
+    }
+    return next;
+}
+
+// copies the text of a line without its escape sequences to visible
+static char * stripLine(Chunk * chunk, const char * line, const char * eol, char * visible)
+{
+    const char * params;
+    char final;
+    for (const char * esc; (esc = memchr(line, '\033', eol - line)); )
+    {
+        memcpy(visible, line, esc - line);
+        visible += esc - line;
+        line = skipEscape(esc, eol, &params, &final);
+        if (final == 'm' && (line - params == 1 || (line - params == 2 && *params == '0')))
+            chunk->lastReset = line;
+    }
+    memcpy(visible, line, eol - line);
+    return visible + (eol - line);
+}
+
+// brings the state up to pos, given the end of the last plain reset before it
+static void replayTo(Chunk * chunk, const char * pos, const char * lastReset)
+{
+    if (lastReset > chunk->replayed)
+    {
+        chunk->state = defaultSgrState;
+        chunk->replayed = lastReset;
+    }
+    const char * cur = chunk->replayed, * params;
+    char final;
+    for (const char * esc; (esc = memchr(cur, '\033', pos - cur)); )
+    {
+        cur = skipEscape(esc, pos, &params, &final);
+        if (final == 'm') applySgrParams(&chunk->state, params, cur - 1 - params);
+    }
+    chunk->replayed = pos;
+}
+
+static void addLine(Chunk * chunk, const char * line, const char * eol, size_t lineNum,
+                    const char * lastReset, const char * lastResetAtEnd)
+{
+    if (countOnly) // no line or state is needed
+    {
+        ++chunk->matchCount;
+        return;
+    }
+    if (chunk->matchCount == chunk->matchCap)
+    {
+        size_t cap = chunk->matchCap ? chunk->matchCap * 2 : 256;
+        Match * matches = realloc(chunk->matches, cap * sizeof(Match));
+        if (!matches) { chunk->failed = true; return; }
+        chunk->matches = matches;
+        chunk->matchCap = cap;
+    }
+    Match * match = &chunk->matches[chunk->matchCount++];
+    match->start = line - chunk->start;
+    match->len = eol - line;
+    match->lineNum = lineNum;
+    replayTo(chunk, line, lastReset);
+    match->state = chunk->state;
+    replayTo(chunk, eol, lastResetAtEnd);
+    match->endState = chunk->state;
+}
+
+// lines without escape sequences, searched as they are
+static void searchPlainLines(Chunk * chunk, const char * pos, const char * end, size_t * lineNum)
+{
+    size_t matchAt;
+    while (pos < end && !chunk->failed)
+    {
+        const char * line = end, * eol;
+        if (findMatch(pos, end - pos, &matchAt))
+            for (line = pos + matchAt; line > pos && line[-1] != '\n'; --line);
+        if (invertMatch)
+            for (; pos < line; pos = eol + 1, ++*lineNum)
+                addLine(chunk, pos, eol = lineEnd(pos, line), *lineNum, chunk->lastReset, chunk->lastReset);
+        else if (lineNumbers)
+            *lineNum += countLines(pos, line);
+        if (line == end) break;
+        eol = lineEnd(line, end);
+        if (!invertMatch)
+            addLine(chunk, line, eol, *lineNum, chunk->lastReset, chunk->lastReset);
+        ++*lineNum;
+        pos = eol + 1;
+    }
+}
+
+// lines with escape sequences, searched a block at a time after being stripped of them
+static const size_t blockSize = 1 << 16;
+
+static void addBlockLine(Chunk * chunk, size_t i, size_t firstLineNum)
+{
+    LineStart * lineStarts = chunk->lineStarts;
+    addLine(chunk, lineStarts[i].line, lineStarts[i + 1].line - 1, firstLineNum + i,
+            lineStarts[i].lastReset, lineStarts[i + 1].lastReset);
+}
+
+static void searchStrippedLines(Chunk * chunk, const char * pos, const char * end, size_t * lineNum)
+{
+    if ((size_t)(end - pos) >= chunk->visibleCap)
+    {
+        size_t cap = (end - pos) + blockSize;
+        char * visible = realloc(chunk->visible, cap);
+        if (!visible) { chunk->failed = true; return; }
+        chunk->visible = visible;
+        chunk->visibleCap = cap;
+    }
+
+    // strip, noting where each line starts in the visible text
+    size_t lineCount = 0;
+    char * visible = chunk->visible;
+    const char * line = pos;
+    for (; line < end; ++lineCount)
+    {
+        if (lineCount == chunk->lineStartCap)
+        {
+            size_t cap = chunk->lineStartCap ? chunk->lineStartCap * 2 : 1024;
+            LineStart * lineStarts = realloc(chunk->lineStarts, (cap + 1) * sizeof(LineStart));
+            if (!lineStarts) { chunk->failed = true; return; }
+            chunk->lineStarts = lineStarts;
+            chunk->lineStartCap = cap;
+        }
+        const char * eol = lineEnd(line, end);
+        chunk->lineStarts[lineCount] = (LineStart){line, visible - chunk->visible, chunk->lastReset};
+        visible = stripLine(chunk, line, eol, visible);
+        *visible++ = '\n';
+        line = eol + 1;
+    }
+    LineStart * lineStarts = chunk->lineStarts;
+    size_t visibleLen = visible - chunk->visible;
+    lineStarts[lineCount] = (LineStart){line, visibleLen, chunk->lastReset}; // after the last newline, real or not
+
+    size_t matchAt;
+    for (size_t i = 0, matched; i < lineCount && !chunk->failed; i = matched + 1)
+    {
+        matched = lineCount;
+        if (findMatch(chunk->visible + lineStarts[i].visible, visibleLen - lineStarts[i].visible, &matchAt))
+            for (matched = i, matchAt += lineStarts[i].visible; lineStarts[matched + 1].visible <= matchAt; ++matched);
+        if (invertMatch)
+            for (; i < matched; ++i)
+                addBlockLine(chunk, i, *lineNum);
+        else if (matched < lineCount)
+            addBlockLine(chunk, matched, *lineNum);
+    }
+    *lineNum += lineCount;
+}
+
+static void * searchChunk(void * arg)
+{
+    Chunk * chunk = arg;
+    const char * pos = chunk->start, * end = chunk->end;
+    size_t lineNum = 0;
+    chunk->replayed = pos;
+
+    while (pos < end && !chunk->failed)
+    {
+        // up to the start of the line with the next escape sequence, then a block from there
+        const char * esc = memchr(pos, '\033', end - pos), * escLine = esc ? esc : end;
+        while (escLine > pos && escLine[-1] != '\n') --escLine;
+        searchPlainLines(chunk, pos, escLine, &lineNum);
+        if (!esc) break;
+        const char * blockEnd = (size_t)(end - escLine) > blockSize ? lineEnd(escLine + blockSize, end) : end;
+        if (blockEnd < end) ++blockEnd; // past the newline
+        searchStrippedLines(chunk, escLine, blockEnd, &lineNum);
+        pos = blockEnd;
+    }
+    replayTo(chunk, end, chunk->lastReset);
+    chunk->lineCount = lineNum;
+    return NULL;
+}
+
+//
+// searching a file
+
+static int threadCount = 0; // 0 for as many as processors
+static const size_t minChunkSize = 1 << 20;
+static FILE * out;
+static bool anyMatch = false, showFileNames = false;
+
+static bool searchText(const char * fileName, const char * text, size_t textLen)
+{
+    size_t chunkCount = threadCount;
+    if (textLen / chunkCount < minChunkSize)
+        chunkCount = textLen / minChunkSize + 1;
+    Chunk * chunks = calloc(chunkCount, sizeof(Chunk));
+    pthread_t * threads = calloc(chunkCount, sizeof(pthread_t));
+    if (!chunks || !threads)
+    {
+        free(chunks); free(threads);
+        fprintf(stderr, "ta-grep: could not allocate memory for searching ‘%s’\n", fileName);
+        return false;
+    }
+
+    // chunks of about equal size, each ending after a newline
+    const char * pos = text, * end = text + textLen;
+    size_t n = 0;
+    for (; n < chunkCount && pos < end; ++n)
+    {
+        const char * chunkEnd = (n == chunkCount - 1) ? end : pos + textLen / chunkCount;
+        if (chunkEnd >= end)
+            chunkEnd = end;
+        else
+        {
+            chunkEnd = memchr(chunkEnd, '\n', end - chunkEnd);
+            chunkEnd = chunkEnd ? chunkEnd + 1 : end;
+        }
+        chunks[n].start = pos;
+        chunks[n].end = chunkEnd;
+        chunks[n].state = noSgrChange;
+        pos = chunkEnd;
+    }
+    chunkCount = n;
+
+    for (n = 1; n < chunkCount; ++n)
+        chunks[n].threaded = pthread_create(&threads[n], NULL, searchChunk, &chunks[n]) == 0;
+    if (chunkCount) searchChunk(&chunks[0]);
+    for (n = 1; n < chunkCount; ++n)
+        if (chunks[n].threaded) pthread_join(threads[n], NULL);
+        else searchChunk(&chunks[n]); // if the thread could not be created
+
+    bool success = true;
+    SgrState chunkStart = defaultSgrState;
+    size_t lineBase = 1, matchCount = 0;
+    char code[64];
+    for (n = 0; n < chunkCount; ++n)
+    {
+        Chunk * chunk = &chunks[n];
+        if (chunk->failed)
+        {
+            fprintf(stderr, "ta-grep: could not allocate memory for searching ‘%s’\n", fileName);
+            success = false;
+            break;
+        }
+        matchCount += chunk->matchCount;
+        for (size_t i = 0; i < chunk->matchCount && !countOnly; ++i)
+        {
+            Match * match = &chunk->matches[i];
+            const char * line = chunk->start + match->start;
+            if (showFileNames) fprintf(out, "%s:", fileName);
+            if (lineNumbers) fprintf(out, "%zu:", lineBase + match->lineNum);
+            SgrState state = composeSgrStates(&chunkStart, &match->state);
+            fwrite(code, 1, writeSgrState(code, &state), out);
+            fwrite(line, 1, match->len, out);
+            state = composeSgrStates(&chunkStart, &match->endState);
+            if (writeSgrState(code, &state)) // i.e. not the default at the end of the line
+                fputs("\033[0m", out);
+            putc('\n', out);
+        }
+        chunkStart = composeSgrStates(&chunkStart, &chunk->state);
+        lineBase += chunk->lineCount;
+    }
+    if (countOnly)
+    {
+        if (showFileNames) fprintf(out, "%s:", fileName);
+        fprintf(out, "%zu\n", matchCount);
+    }
+    anyMatch |= matchCount != 0;
+
+    for (n = 0; n < chunkCount; ++n)
+    {
+        free(chunks[n].matches);
+        free(chunks[n].visible);
+        free(chunks[n].lineStarts);
+    }
+    free(chunks);
+    free(threads);
+    return success;
+}
+
+static bool searchFile(const char * fileName)
+{
+    if (strcmp(fileName, "-") == 0)
+    // standard input, which may not be mappable, is read whole
+    {
+        size_t len = 0, cap = 1 << 16;
+        char * text = malloc(cap);
+        for (size_t got; text && (got = fread(text + len, 1, cap - len, stdin)) > 0; )
+            if ((len += got) == cap)
+            {
+                char * grown = realloc(text, cap *= 2);
+                if (!grown) free(text);
+                text = grown;
+            }
+        if (!text)
+        {
+            fputs("ta-grep: could not allocate memory for reading standard input\n", stderr);
+            return false;
+        }
+        bool success = searchText("(standard input)", text, len);
+        free(text);
+        return success;
+    }
+
+    int fd = open(fileName, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0)
+    {
+        fprintf(stderr, "ta-grep: could not open ‘%s’\n", fileName);
+        if (fd >= 0) close(fd);
+        return false;
+    }
+    if (st.st_size == 0)
+    {
+        close(fd);
+        return searchText(fileName, "", 0);
+    }
+    char * text = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (text == MAP_FAILED)
+    {
+        fprintf(stderr, "ta-grep: could not map ‘%s’\n", fileName);
+        return false;
+    }
+    madvise(text, st.st_size, MADV_SEQUENTIAL);
+    bool success = searchText(fileName, text, st.st_size);
+    munmap(text, st.st_size);
+    return success;
+}
+
+//
+// command line
+
+static void printSyntax(void)
+{
+    TaProfile profile = taDetectProfile(2);
+    const char * F = ta_p("f", profile), * I = ta_p("i", profile), * W = ta_p("w", profile),
+               * N = ta_p("n", profile), * G = ta_p("+g", profile), * C = ta_p("+c", profile);
+    fprintf(stderr, "\n%sta%s-%sgrep%s: Searches text with ANSI color and attribute escape codes by its visible text\n\n"
+                    "%s    USAGE%s: ta-grep [%soptions%s] %spattern%s [%sfile%s...]\n\n"
+                    "The pattern is a POSIX basic regular expression, matched against the text\n"
+                    "without its escape codes. Matching lines are printed with the colors and\n"
+                    "attributes in effect at their start. Without files, standard input is read.\n\n"
+                    "%sOptions%s:\n"
+                    "    %s-E%s  pattern is an extended regular expression\n"
+                    "    %s-F%s  pattern is a fixed string\n"
+                    "    %s-i%s  ignore case\n"
+                    "    %s-v%s  print the lines which do not match\n"
+                    "    %s-n%s  prefix each line with its line number\n"
+                    "    %s-c%s  print only the count of matching lines\n"
+                    "    %s-j%s %sN%s  search with N threads (default: as many as processors)\n\n"
+                    "The exit status is 0 if any line matched, 1 if none did and 2 on error.\n",
+                    G, W, C, F, W, F, I, F, I, F, I, F, W, F,
+                    G, F, G, F, G, F, G, F, G, F, G, F, G, F, N, F);
+}
+
+int main(int argc, char * argv[])
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "EFivncj:")) != -1)
+        switch (opt)
+        {
+            case 'E': extendedRegex = true; break;
+            case 'F': fixedString = true; break;
+            case 'i': ignoreCase = true; break;
+            case 'v': invertMatch = true; break;
+            case 'n': lineNumbers = true; break;
+            case 'c': countOnly = true; break;
+            case 'j':
+                threadCount = atoi(optarg);
+                if (threadCount < 1) { printSyntax(); return 2; }
+                break;
+            default: printSyntax(); return 2;
+        }
+    if (optind >= argc)
+    {
+        printSyntax();
+        return 2;
+    }
+
+    pattern = argv[optind++];
+    patternLen = strlen(pattern);
+    if (!fixedString && !ignoreCase && !strpbrk(pattern, extendedRegex ? "\\.[]*^$+?(){}|" : "\\.[]*^$"))
+        fixedString = true; // a literal is found faster by memmem
+    if (fixedString && ignoreCase)
+    // searched as an equivalent basic regular expression since memmem is case-sensitive
+    {
+        char * escaped = malloc(patternLen * 2 + 1), * cur = escaped;
+        if (!escaped) return 2;
+        for (const char * c = pattern; *c; ++c)
+        {
+            if (strchr("\\.[]*^$", *c)) *cur++ = '\\';
+            *cur++ = *c;
+        }
+        *cur = '\0';
+        pattern = escaped;
+        fixedString = extendedRegex = false;
+    }
+    if (!fixedString)
+    {
+        int error = regcomp(&regex, pattern, REG_NEWLINE |
+                            (extendedRegex ? REG_EXTENDED : 0) | (ignoreCase ? REG_ICASE : 0));
+        if (error)
+        {
+            char msg[256];
+            regerror(error, &regex, msg, sizeof(msg));
+            fprintf(stderr, "ta-grep: invalid pattern ‘%s’: %s\n", pattern, msg);
+            return 2;
+        }
+    }
+
+    if (threadCount == 0)
+    {
+        long processors = sysconf(_SC_NPROCESSORS_ONLN);
+        threadCount = processors > 0 ? processors : 1;
+    }
+
+    out = stdout;
+    static char outBuf[1 << 16];
+    setvbuf(out, outBuf, _IOFBF, sizeof(outBuf));
+
+    bool success = true;
+    showFileNames = argc - optind > 1;
+    if (optind == argc)
+        success = searchFile("-");
+    for (int i = optind; i < argc; ++i)
+        success &= searchFile(argv[i]);
+    fflush(out);
+
+    return !success ? 2 : anyMatch ? 0 : 1;
+}